@@ -15,28 +15,64 @@
 #include <regex>
 #include <set>
 #include <queue>
+#include <deque>
 #include <stack>
 #include <functional>
 #include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <new>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CMS_HAVE_AVX2_KERNEL 1
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
 #else
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
 #endif
 
 class Logger {
 private:
     std::ofstream logFile;
+    std::mutex logMutex;
     std::string getCurrentTime() {
         auto now = std::chrono::system_clock::now();
         auto time_t = std::chrono::system_clock::to_time_t(now);
+        std::tm local = localTime(time_t);
         std::stringstream ss;
-        ss << std::put_time(std::localtime(&time_t), "%Y-%m-%d %H:%M:%S");
+        ss << std::put_time(&local, "%Y-%m-%d %H:%M:%S");
         return ss.str();
     }
 public:
+    // Thread-safe replacement for std::localtime
+    static std::tm localTime(std::time_t time) {
+        std::tm result = {};
+#ifdef _WIN32
+        localtime_s(&result, &time);
+#else
+        localtime_r(&time, &result);
+#endif
+        return result;
+    }
+    
     Logger(const std::string& filename = "contact_manager.log") {
         logFile.open(filename, std::ios::app);
     }
@@ -48,6 +84,7 @@ public:
     }
     
     void log(const std::string& message, const std::string& level = "INFO") {
+        std::lock_guard<std::mutex> lock(logMutex);
         if (logFile.is_open()) {
             logFile << "[" << getCurrentTime() << "] [" << level << "] " << message << std::endl;
         }
@@ -88,27 +125,75 @@ public:
     }
 };
 
+// Repeating-key XOR cipher applied in fixed-size blocks. The key is
+// expanded once into a keystream block so the inner loop is a plain
+// buffer-to-buffer XOR with no per-byte modulo, done 16 bytes at a time
+// with SSE2 where available. Any byte range can be processed on its own
+// given its offset in the stream, so callers can encrypt while they
+// serialize and decrypt single records or blocks for random access.
 class SimpleEncryption {
+public:
+    static const size_t kBlockSize = 64 * 1024;
+
 private:
     std::string key;
+    std::string keystream; // key repeated to cover kBlockSize + key.length()
     
-    std::string simpleXOR(const std::string& data, const std::string& key) {
-        std::string result = data;
-        for (size_t i = 0; i < data.length(); ++i) {
-            result[i] = data[i] ^ key[i % key.length()];
+    static void xorBlock(char* data, const char* stream, size_t length) {
+        size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        for (; i + 16 <= length; i += 16) {
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(stream + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(d, k));
+        }
+#endif
+        for (; i + 8 <= length; i += 8) {
+            uint64_t d, k;
+            std::memcpy(&d, data + i, 8);
+            std::memcpy(&k, stream + i, 8);
+            d ^= k;
+            std::memcpy(data + i, &d, 8);
+        }
+        for (; i < length; ++i) {
+            data[i] ^= stream[i];
         }
+    }
+    
+    std::string simpleXOR(const std::string& data) const {
+        std::string result = data;
+        applyInPlace(&result[0], result.size());
         return result;
     }
     
 public:
-    SimpleEncryption(const std::string& encryptionKey = "default_key_123") : key(encryptionKey) {}
+    SimpleEncryption(const std::string& encryptionKey = "default_key_123") : key(encryptionKey) {
+        if (!key.empty()) {
+            size_t length = kBlockSize + key.length();
+            keystream.reserve(length + key.length());
+            while (keystream.size() < length) keystream += key;
+        }
+    }
     
     std::string encrypt(const std::string& data) {
-        return simpleXOR(data, key);
+        return simpleXOR(data);
     }
     
     std::string decrypt(const std::string& data) {
-        return simpleXOR(data, key);
+        return simpleXOR(data);
+    }
+    
+    // XOR a buffer in place, starting at position streamOffset of the key
+    // stream. Encrypting and decrypting are the same operation.
+    void applyInPlace(char* data, size_t length, uint64_t streamOffset = 0) const {
+        if (key.empty()) return;
+        size_t done = 0;
+        while (done < length) {
+            size_t chunk = std::min(kBlockSize, length - done);
+            size_t start = static_cast<size_t>((streamOffset + done) % key.length());
+            xorBlock(data + done, keystream.data() + start, chunk);
+            done += chunk;
+        }
     }
     
     static std::string simpleHash(const std::string& password) {
@@ -121,9 +206,247 @@ public:
     }
 };
 
+const size_t SimpleEncryption::kBlockSize;
+
+// Read-only view of a whole file. Uses mmap where available so large data
+// files are paged in on demand instead of being copied into a buffer.
+class MappedFile {
+private:
+    const char* data;
+    size_t length;
+#ifdef _WIN32
+    std::vector<char> buffer;
+#endif
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+public:
+    MappedFile() : data(nullptr), length(0) {}
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(const std::string& path) {
+        close();
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open()) return false;
+        buffer.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        if (!buffer.empty()) file.read(buffer.data(), buffer.size());
+        data = buffer.data();
+        length = buffer.size();
+        return true;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        length = static_cast<size_t>(st.st_size);
+        if (length > 0) {
+            void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                ::close(fd);
+                length = 0;
+                return false;
+            }
+            madvise(mapped, length, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(mapped);
+        }
+        ::close(fd);
+        return true;
+#endif
+    }
+
+    void close() {
+#ifdef _WIN32
+        std::vector<char>().swap(buffer);
+#else
+        if (data != nullptr) {
+            munmap(const_cast<char*>(data), length);
+        }
+#endif
+        data = nullptr;
+        length = 0;
+    }
+
+    const char* begin() const { return data; }
+    size_t size() const { return length; }
+};
+
+// Little-endian integer helpers for the binary file formats.
+class BinaryCodec {
+public:
+    static void putU32(std::string& out, uint32_t value) {
+        for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+
+    static void putU64(std::string& out, uint64_t value) {
+        for (int i = 0; i < 8; ++i) out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+
+    static void putString(std::string& out, const std::string& value) {
+        putU32(out, static_cast<uint32_t>(value.size()));
+        out.append(value);
+    }
+
+    static uint32_t getU32(const char* p) {
+        const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+        return static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1]) << 8) |
+               (static_cast<uint32_t>(b[2]) << 16) | (static_cast<uint32_t>(b[3]) << 24);
+    }
+
+    static uint64_t getU64(const char* p) {
+        return static_cast<uint64_t>(getU32(p)) | (static_cast<uint64_t>(getU32(p + 4)) << 32);
+    }
+
+    // FNV-1a, used to detect torn or corrupted records
+    static uint32_t checksum(const char* data, size_t length) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < length; ++i) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+};
+
+// Small LZ77 codec in the style of LZ4's block format, used for compressed
+// snapshots. A compressed block is a series of sequences:
+//   token   : high nibble literal length, low nibble match length - 4
+//             (15 means more length bytes follow, each adding up to 255)
+//   literals, then a u16 match offset back into the output
+// The last sequence carries literals only. Decompression checks every
+// length and offset against both buffers, so corrupt input fails cleanly.
+class BlockCompressor {
+private:
+    static const int kHashBits = 14;
+    static const size_t kMinMatch = 4;
+    static const size_t kLastLiterals = 5;
+    static const size_t kMaxOffset = 65535;
+
+    static uint32_t read32(const char* p) {
+        uint32_t value;
+        std::memcpy(&value, p, 4);
+        return value;
+    }
+
+    static void putLength(std::string& out, size_t length) {
+        for (; length >= 255; length -= 255) out.push_back(static_cast<char>(255));
+        out.push_back(static_cast<char>(length));
+    }
+
+    static bool getLength(const unsigned char*& p, const unsigned char* end, size_t& length) {
+        unsigned char byte;
+        do {
+            if (p >= end) return false;
+            byte = *p++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    static void putSequence(std::string& out, const char* literals, size_t literalLength,
+                            size_t offset, size_t matchLength) {
+        size_t matchCode = matchLength ? matchLength - kMinMatch : 0;
+        out.push_back(static_cast<char>((std::min<size_t>(literalLength, 15) << 4) |
+                                        std::min<size_t>(matchCode, 15)));
+        if (literalLength >= 15) putLength(out, literalLength - 15);
+        out.append(literals, literalLength);
+        if (matchLength == 0) return;
+        out.push_back(static_cast<char>(offset & 0xFF));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (matchCode >= 15) putLength(out, matchCode - 15);
+    }
+
+public:
+    static void compress(const char* data, size_t length, std::string& out) {
+        std::vector<uint32_t> table(size_t(1) << kHashBits, 0);
+        size_t anchor = 0;
+        size_t position = 0;
+        size_t limit = length > kLastLiterals + kMinMatch ? length - kLastLiterals : 0;
+
+        while (position + kMinMatch <= limit) {
+            uint32_t sequence = read32(data + position);
+            uint32_t slot = (sequence * 2654435761u) >> (32 - kHashBits);
+            size_t candidate = table[slot];
+            table[slot] = static_cast<uint32_t>(position);
+
+            if (candidate < position && position - candidate <= kMaxOffset &&
+                read32(data + candidate) == sequence) {
+                size_t matchEnd = position + kMinMatch;
+                while (matchEnd < limit && data[matchEnd] == data[candidate + matchEnd - position]) {
+                    ++matchEnd;
+                }
+                putSequence(out, data + anchor, position - anchor, position - candidate, matchEnd - position);
+                position = matchEnd;
+                anchor = position;
+            } else {
+                // Step faster through data that keeps failing to match
+                position += 1 + ((position - anchor) >> 6);
+            }
+        }
+        putSequence(out, data + anchor, length - anchor, 0, 0);
+    }
+
+    // Returns false unless the input decodes to exactly rawLength bytes.
+    static bool decompress(const char* data, size_t length, char* out, size_t rawLength) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        const unsigned char* end = p + length;
+        size_t written = 0;
+
+        while (p < end) {
+            unsigned token = *p++;
+            size_t literalLength = token >> 4;
+            if (literalLength == 15 && !getLength(p, end, literalLength)) return false;
+            if (literalLength > static_cast<size_t>(end - p) || literalLength > rawLength - written) return false;
+            std::memcpy(out + written, p, literalLength);
+            p += literalLength;
+            written += literalLength;
+            if (p == end) break;
+
+            if (end - p < 2) return false;
+            size_t offset = p[0] | (static_cast<size_t>(p[1]) << 8);
+            p += 2;
+            size_t matchLength = token & 15;
+            if (matchLength == 15 && !getLength(p, end, matchLength)) return false;
+            matchLength += kMinMatch;
+            if (offset == 0 || offset > written || matchLength > rawLength - written) return false;
+
+            const char* from = out + written - offset;
+            if (offset >= matchLength) {
+                std::memcpy(out + written, from, matchLength);
+            } else {
+                for (size_t i = 0; i < matchLength; ++i) out[written + i] = from[i];
+            }
+            written += matchLength;
+        }
+        return written == rawLength;
+    }
+};
+
+// Content-addressed backup store. Each backup splits the data file into
+// content-defined chunks (a gear rolling hash picks the cut points, so an
+// edit only changes the chunks around it) and stores every chunk under its
+// hash in backups/chunks exactly once. A backup itself is a small manifest
+// listing chunk hashes; restoring concatenates the chunks again.
 class BackupManager {
 private:
     std::string backupDir;
+    uint64_t lastTotalBytes;
+    uint64_t lastNewBytes;
+    size_t lastChunkCount;
+    size_t lastNewChunkCount;
+    
+    static const size_t kMinChunk = 2 * 1024;
+    static const size_t kMaxChunk = 64 * 1024;
+    static const uint64_t kChunkMask = (1u << 13) - 1; // ~8 KiB average
     
     void createDirectory(const std::string& path) {
 #ifdef _WIN32
@@ -133,50 +456,510 @@ private:
 #endif
     }
     
+    std::string chunkDir() const {
+        return backupDir + "/chunks";
+    }
+    
+    struct GearTable {
+        uint64_t values[256];
+        
+        GearTable() {
+            // splitmix64 with a fixed seed: cut points must be stable across runs
+            uint64_t state = 0x9E3779B97F4A7C15ull;
+            for (int i = 0; i < 256; ++i) {
+                uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                values[i] = z ^ (z >> 31);
+            }
+        }
+    };
+    
+    static const uint64_t* gearTable() {
+        static const GearTable table;
+        return table.values;
+    }
+    
+    static size_t nextCut(const char* data, size_t length) {
+        if (length <= kMinChunk) return length;
+        const uint64_t* gear = gearTable();
+        size_t limit = std::min(length, kMaxChunk);
+        uint64_t hash = 0;
+        for (size_t i = kMinChunk; i < limit; ++i) {
+            hash = (hash << 1) + gear[static_cast<unsigned char>(data[i])];
+            if ((hash & kChunkMask) == 0) return i + 1;
+        }
+        return limit;
+    }
+    
+    // 128-bit chunk name from two independently seeded 64-bit hashes
+    static std::string chunkHash(const char* data, size_t length) {
+        uint64_t h1 = 1469598103934665603ull;
+        uint64_t h2 = 0x6A09E667F3BCC909ull ^ length;
+        for (size_t i = 0; i < length; ++i) {
+            unsigned char c = static_cast<unsigned char>(data[i]);
+            h1 = (h1 ^ c) * 1099511628211ull;
+            h2 = (h2 + c + 1) * 0x9E3779B97F4A7C15ull;
+            h2 ^= h2 >> 29;
+        }
+        char name[33];
+        std::snprintf(name, sizeof(name), "%016llx%016llx",
+                      static_cast<unsigned long long>(h1), static_cast<unsigned long long>(h2));
+        return name;
+    }
+    
+    static bool writeFileAtomically(const std::string& path, const char* data, size_t length) {
+        std::string tempPath = path + ".tmp";
+        std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return false;
+        out.write(data, length);
+        out.close();
+        if (!out) {
+            std::remove(tempPath.c_str());
+            return false;
+        }
+#ifdef _WIN32
+        std::remove(path.c_str());
+#endif
+        return std::rename(tempPath.c_str(), path.c_str()) == 0;
+    }
+    
+    // Reads a stored chunk into data, failing when it is missing, has the
+    // wrong length or no longer hashes to its name
+    static bool readChunk(const std::string& path, const std::string& hash, size_t length,
+                          std::string& data) {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in.is_open() || static_cast<size_t>(in.tellg()) != length) return false;
+        data.resize(length);
+        in.seekg(0);
+        if (length > 0 && !in.read(&data[0], length)) return false;
+        return chunkHash(data.data(), length) == hash;
+    }
+    
+    // Only the size is checked, so a backup reads nothing it already
+    // stored; restores verify the content hash
+    static bool hasChunk(const std::string& path, size_t length) {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        return in.is_open() && static_cast<size_t>(in.tellg()) == length;
+    }
+    
+    static bool endsWith(const std::string& value, const std::string& suffix) {
+        return value.size() >= suffix.size() &&
+               value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+    
+    // Manifests list one "<hash> <length>" line per chunk. Version 2 ends
+    // with "end <chunks> <bytes>", so a truncated manifest is refused
+    // instead of restoring part of the file; version 1 has no totals.
+    bool restoreFromManifest(const std::string& manifestFile, const std::string& targetFile) {
+        std::ifstream manifest(manifestFile);
+        std::string format;
+        std::getline(manifest, format);
+        bool totalled = format == "CMSBACKUP 2";
+        if (!totalled && format != "CMSBACKUP 1") {
+            return false;
+        }
+        
+        std::string tempPath = targetFile + ".tmp";
+        std::ofstream dst(tempPath, std::ios::binary | std::ios::trunc);
+        if (!dst.is_open()) return false;
+        
+        std::string line;
+        std::string data;
+        size_t chunks = 0;
+        uint64_t bytes = 0;
+        bool ended = false;
+        bool ok = true;
+        while (ok && std::getline(manifest, line)) {
+            std::istringstream fields(line);
+            std::string hash;
+            std::string extra;
+            uint64_t length;
+            if (ended || !(fields >> hash >> length)) {
+                ok = false;
+            } else if (hash == "end") {
+                uint64_t total;
+                ok = totalled && (fields >> total) && length == chunks && total == bytes;
+                ended = true;
+            } else {
+                ok = readChunk(chunkDir() + "/" + hash, hash, static_cast<size_t>(length), data);
+                if (ok) {
+                    dst.write(data.data(), data.size());
+                    ++chunks;
+                    bytes += length;
+                }
+            }
+            if (ok && (fields >> extra)) ok = false;
+        }
+        ok = ok && manifest.eof() && (ended || !totalled);
+        dst.close();
+        if (!ok || !dst) {
+            std::remove(tempPath.c_str());
+            return false;
+        }
+#ifdef _WIN32
+        std::remove(targetFile.c_str());
+#endif
+        return std::rename(tempPath.c_str(), targetFile.c_str()) == 0;
+    }
+    
 public:
-    BackupManager(const std::string& dir = "backups") : backupDir(dir) {
+    BackupManager(const std::string& dir = "backups")
+        : backupDir(dir), lastTotalBytes(0), lastNewBytes(0), lastChunkCount(0), lastNewChunkCount(0) {
         // Create backup directory if it doesn't exist
         createDirectory(backupDir);
+        createDirectory(chunkDir());
     }
     
     bool createBackup(const std::string& sourceFile) {
         auto now = std::chrono::system_clock::now();
         auto time_t = std::chrono::system_clock::to_time_t(now);
+        std::tm local = Logger::localTime(time_t);
+        auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
         std::stringstream backupName;
-        backupName << backupDir << "/backup_" << std::put_time(std::localtime(&time_t), "%Y%m%d_%H%M%S") << ".dat";
-        
-        std::ifstream src(sourceFile, std::ios::binary);
-        std::ofstream dst(backupName.str(), std::ios::binary);
+        backupName << backupDir << "/backup_" << std::put_time(&local, "%Y%m%d_%H%M%S")
+                   << "_" << std::setw(3) << std::setfill('0') << millis << ".manifest";
         
-        if (!src.is_open() || !dst.is_open()) {
+        MappedFile src;
+        if (!src.open(sourceFile)) {
             return false;
         }
         
-        dst << src.rdbuf();
-        src.close();
-        dst.close();
+        std::string manifest = "CMSBACKUP 2\n";
+        size_t chunks = 0;
+        size_t newChunks = 0;
+        uint64_t newBytes = 0;
+        size_t position = 0;
+        while (position < src.size()) {
+            const char* chunk = src.begin() + position;
+            size_t length = nextCut(chunk, src.size() - position);
+            std::string hash = chunkHash(chunk, length);
+            std::string chunkPath = chunkDir() + "/" + hash;
+            
+            if (!hasChunk(chunkPath, length)) {
+                if (!writeFileAtomically(chunkPath, chunk, length)) {
+                    return false;
+                }
+                ++newChunks;
+                newBytes += length;
+            }
+            manifest += hash + " " + std::to_string(length) + "\n";
+            ++chunks;
+            position += length;
+        }
+        manifest += "end " + std::to_string(chunks) + " " + std::to_string(src.size()) + "\n";
+        
+        if (!writeFileAtomically(backupName.str(), manifest.data(), manifest.size())) {
+            return false;
+        }
+        lastTotalBytes = src.size();
+        lastNewBytes = newBytes;
+        lastChunkCount = chunks;
+        lastNewChunkCount = newChunks;
         return true;
     }
     
     std::vector<std::string> listBackups() {
         std::vector<std::string> backups;
-        // Simple implementation - in production, you'd use filesystem library
+#ifdef _WIN32
+        WIN32_FIND_DATAA entry;
+        HANDLE handle = FindFirstFileA((backupDir + "/backup_*").c_str(), &entry);
+        if (handle != INVALID_HANDLE_VALUE) {
+            do {
+                std::string name = entry.cFileName;
+                if (endsWith(name, ".manifest") || endsWith(name, ".dat")) {
+                    backups.push_back(backupDir + "/" + name);
+                }
+            } while (FindNextFileA(handle, &entry));
+            FindClose(handle);
+        }
+#else
+        DIR* dir = opendir(backupDir.c_str());
+        if (dir != nullptr) {
+            while (dirent* entry = readdir(dir)) {
+                std::string name = entry->d_name;
+                // Skips .tmp files left behind by an interrupted backup
+                if (name.compare(0, 7, "backup_") == 0 &&
+                    (endsWith(name, ".manifest") || endsWith(name, ".dat"))) {
+                    backups.push_back(backupDir + "/" + name);
+                }
+            }
+            closedir(dir);
+        }
+#endif
+        std::sort(backups.begin(), backups.end());
         return backups;
     }
     
+    // Accepts chunked manifests and the full-copy .dat backups made by
+    // older versions
     bool restoreBackup(const std::string& backupFile, const std::string& targetFile) {
+        if (endsWith(backupFile, ".manifest")) {
+            return restoreFromManifest(backupFile, targetFile);
+        }
+        
         std::ifstream src(backupFile, std::ios::binary);
-        std::ofstream dst(targetFile, std::ios::binary);
+        if (!src.is_open()) {
+            return false;
+        }
         
-        if (!src.is_open() || !dst.is_open()) {
+        std::string tempPath = targetFile + ".tmp";
+        std::ofstream dst(tempPath, std::ios::binary | std::ios::trunc);
+        if (!dst.is_open()) {
             return false;
         }
         
-        dst << src.rdbuf();
+        // Streaming an empty buffer would set failbit on dst
+        if (src.peek() != std::char_traits<char>::eof()) {
+            dst << src.rdbuf();
+        }
         src.close();
         dst.close();
+        if (!dst) {
+            std::remove(tempPath.c_str());
+            return false;
+        }
+#ifdef _WIN32
+        std::remove(targetFile.c_str());
+#endif
+        return std::rename(tempPath.c_str(), targetFile.c_str()) == 0;
+    }
+    
+    uint64_t getLastTotalBytes() const { return lastTotalBytes; }
+    uint64_t getLastNewBytes() const { return lastNewBytes; }
+    size_t getLastChunkCount() const { return lastChunkCount; }
+    size_t getLastNewChunkCount() const { return lastNewChunkCount; }
+};
+
+const size_t BackupManager::kMinChunk;
+const size_t BackupManager::kMaxChunk;
+const uint64_t BackupManager::kChunkMask;
+
+// Sequential file writer with two fixed-size buffers. The caller fills one
+// block while a background thread writes the other, so serialization and
+// encryption overlap with disk I/O and memory stays at two blocks no
+// matter how large the file is.
+class BlockWriter {
+private:
+    std::FILE* file;
+    size_t blockSize;
+    std::vector<char> blocks[2];
+    size_t fill;
+    int current;
+    uint64_t position;
+
+    std::thread ioThread;
+    std::mutex ioMutex;
+    std::condition_variable ioReady;
+    bool writePending;
+    size_t pendingLength;
+    int pendingBlock;
+    bool stopping;
+    bool failed;
+
+    BlockWriter(const BlockWriter&);
+    BlockWriter& operator=(const BlockWriter&);
+
+    void ioLoop() {
+        std::unique_lock<std::mutex> lock(ioMutex);
+        while (true) {
+            ioReady.wait(lock, [this]() { return writePending || stopping; });
+            if (!writePending) return;
+            int block = pendingBlock;
+            size_t length = pendingLength;
+            lock.unlock();
+            bool ok = std::fwrite(blocks[block].data(), 1, length, file) == length;
+            lock.lock();
+            if (!ok) failed = true;
+            writePending = false;
+            ioReady.notify_all();
+        }
+    }
+
+    // Hands the current block to the I/O thread and switches buffers
+    void submit() {
+        if (fill == 0) return;
+        std::unique_lock<std::mutex> lock(ioMutex);
+        ioReady.wait(lock, [this]() { return !writePending; });
+        pendingBlock = current;
+        pendingLength = fill;
+        writePending = true;
+        ioReady.notify_all();
+        current = 1 - current;
+        fill = 0;
+    }
+
+public:
+    explicit BlockWriter(size_t blockSize = 1024 * 1024)
+        : file(nullptr), blockSize(blockSize), fill(0), current(0), position(0),
+          writePending(false), pendingLength(0), pendingBlock(0), stopping(false), failed(false) {}
+
+    ~BlockWriter() {
+        finish();
+        if (file != nullptr) std::fclose(file);
+    }
+
+    bool open(const std::string& path) {
+        file = std::fopen(path.c_str(), "wb");
+        if (file == nullptr) return false;
+        blocks[0].resize(blockSize);
+        blocks[1].resize(blockSize);
+        ioThread = std::thread(&BlockWriter::ioLoop, this);
         return true;
     }
+
+    // Returns space for length bytes in the current block; call commit()
+    // with the number of bytes actually used. Lengths above the block size
+    // grow both buffers.
+    char* reserve(size_t length) {
+        if (fill + length > blocks[current].size()) {
+            submit();
+            if (length > blocks[current].size()) {
+                std::unique_lock<std::mutex> lock(ioMutex);
+                ioReady.wait(lock, [this]() { return !writePending; });
+                blocks[0].resize(length);
+                blocks[1].resize(length);
+            }
+        }
+        return blocks[current].data() + fill;
+    }
+
+    void commit(size_t length) {
+        fill += length;
+        position += length;
+    }
+
+    void append(const char* data, size_t length) {
+        std::memcpy(reserve(length), data, length);
+        commit(length);
+    }
+
+    uint64_t tell() const { return position; }
+
+    // Flushes buffered blocks and stops the I/O thread. The file stays open
+    // for patch() until the writer is closed.
+    bool finish() {
+        if (!ioThread.joinable()) return !failed;
+        submit();
+        {
+            std::lock_guard<std::mutex> lock(ioMutex);
+            stopping = true;
+        }
+        ioReady.notify_all();
+        ioThread.join();
+        return !failed;
+    }
+
+    // Overwrites bytes already written, e.g. a header filled in last
+    bool patch(uint64_t offset, const char* data, size_t length) {
+        return std::fseek(file, static_cast<long>(offset), SEEK_SET) == 0 &&
+               std::fwrite(data, 1, length, file) == length;
+    }
+
+    bool close() {
+        bool ok = finish();
+        if (file != nullptr) {
+            ok = std::fflush(file) == 0 && ok;
+#ifdef _WIN32
+            _commit(_fileno(file));
+#else
+            fsync(fileno(file));
+#endif
+            ok = std::fclose(file) == 0 && ok;
+            file = nullptr;
+        }
+        return ok;
+    }
+};
+
+// Splits [0, count) into contiguous shards processed on separate threads.
+// Shards are never smaller than minPerShard, so small inputs stay on the
+// calling thread where starting threads would cost more than it saves.
+class ParallelRange {
+public:
+    static size_t shardCount(size_t count, size_t minPerShard) {
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        return std::max<size_t>(1, std::min<size_t>(threads, count / minPerShard));
+    }
+
+    // Calls fn(shard, begin, end) for each shard; shard 0 runs on the caller
+    template <typename Fn>
+    static void run(size_t count, size_t shards, Fn fn) {
+        if (shards <= 1) {
+            fn(0, 0, count);
+            return;
+        }
+        std::vector<std::thread> threads;
+        threads.reserve(shards - 1);
+        for (size_t shard = 1; shard < shards; ++shard) {
+            threads.emplace_back(fn, shard, count * shard / shards, count * (shard + 1) / shards);
+        }
+        fn(0, 0, count / shards);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    template <typename T>
+    static void concat(std::vector<std::vector<T>>& parts, std::vector<T>& out) {
+        size_t total = out.size();
+        for (const auto& part : parts) total += part.size();
+        out.reserve(total);
+        for (auto& part : parts) {
+            std::move(part.begin(), part.end(), std::back_inserter(out));
+            std::vector<T>().swap(part);
+        }
+    }
+};
+
+// A birthday parsed into its parts, so date arithmetic never goes back to
+// the string. month is 0 when there is no birthday or it is not a valid
+// YYYY-MM-DD date.
+struct BirthDate {
+    int16_t year;
+    uint8_t month;
+    uint8_t day;
+    
+    BirthDate() : year(0), month(0), day(0) {}
+    
+    bool isSet() const { return month != 0; }
+    
+    static bool isLeapYear(int year) {
+        return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    }
+    
+    static int daysInMonth(int year, int month) {
+        static const int kDays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        return month == 2 && isLeapYear(year) ? 29 : kDays[month - 1];
+    }
+    
+    // Days since 1970-01-01 of a Gregorian date; a day past the end of a
+    // month, such as February 29 in a common year, counts as the 1st of
+    // the next
+    static int dayNumber(int year, int month, int day) {
+        year -= month <= 2;
+        int era = (year >= 0 ? year : year - 399) / 400;
+        int yearOfEra = year - era * 400;
+        int dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + dayOfEra - 719468;
+    }
+    
+    static BirthDate parse(const std::string& text) {
+        BirthDate date;
+        if (text.size() != 10 || text[4] != '-' || text[7] != '-') return date;
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (i != 4 && i != 7 && !std::isdigit(static_cast<unsigned char>(text[i]))) return date;
+        }
+        int year = std::atoi(text.substr(0, 4).c_str());
+        int month = std::atoi(text.substr(5, 2).c_str());
+        int day = std::atoi(text.substr(8, 2).c_str());
+        if (month < 1 || month > 12 || day < 1 || day > daysInMonth(year, month)) return date;
+        date.year = static_cast<int16_t>(year);
+        date.month = static_cast<uint8_t>(month);
+        date.day = static_cast<uint8_t>(day);
+        return date;
+    }
 };
 
 class Contact {
@@ -196,7 +979,53 @@ private:
     std::time_t modifiedDate;
     bool isFavorite;
     int contactId;
-    static int nextId;
+    static std::atomic<int> nextId;
+
+    // Lowercased copies of the searchable fields, kept in step by the
+    // setters and loaders so that searches never fold per query. Phone
+    // numbers have no case and are searched as stored.
+    struct FoldedFields {
+        std::string name;
+        std::string email;
+        std::string address;
+        std::string notes;
+        std::string company;
+        std::string jobTitle;
+        std::string website;
+        std::string socialMedia;
+        std::vector<std::string> tags;
+    };
+    FoldedFields folded;
+    BirthDate birthDate; // birthday parsed, kept in step the same way
+
+    void refold() {
+        folded.name = foldCase(name);
+        folded.email = foldCase(email);
+        folded.address = foldCase(address);
+        folded.notes = foldCase(notes);
+        folded.company = foldCase(company);
+        folded.jobTitle = foldCase(jobTitle);
+        folded.website = foldCase(website);
+        folded.socialMedia = foldCase(socialMedia);
+        folded.tags.clear();
+        for (const auto& tag : tags) folded.tags.push_back(foldCase(tag));
+        birthDate = BirthDate::parse(birthday);
+    }
+
+    // Loaders may run on several threads, so raising nextId is a CAS loop
+    static void raiseNextId(int usedId) {
+        int current = nextId.load();
+        while (usedId >= current && !nextId.compare_exchange_weak(current, usedId + 1)) {
+        }
+    }
+
+    friend class ContactCodec;
+    friend class TextRecordParser;
+
+    // Used when materializing stored records; unlike the public constructors
+    // it does not consume an id from nextId.
+    explicit Contact(int existingId)
+        : createdDate(0), modifiedDate(0), isFavorite(false), contactId(existingId) {}
 
 public:
     Contact() : name(""), phone(""), email(""), address(""), notes(""), company(""), 
@@ -210,47 +1039,72 @@ public:
         : name(name), phone(phone), email(email), address(address), 
           company(company), jobTitle(jobTitle), notes(""), birthday(""), website(""),
           socialMedia(""), createdDate(std::time(nullptr)), modifiedDate(std::time(nullptr)),
-          isFavorite(false), contactId(nextId++) {}
+          isFavorite(false), contactId(nextId++) {
+        refold();
+    }
+
+    static std::string foldCase(const std::string& text) {
+        std::string result(text);
+        for (auto& c : result) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        return result;
+    }
 
     // Getters
-    std::string getName() const { return name; }
-    std::string getPhone() const { return phone; }
-    std::string getEmail() const { return email; }
-    std::string getAddress() const { return address; }
-    std::string getNotes() const { return notes; }
-    std::string getCompany() const { return company; }
-    std::string getJobTitle() const { return jobTitle; }
-    std::string getBirthday() const { return birthday; }
-    std::string getWebsite() const { return website; }
-    std::vector<std::string> getTags() const { return tags; }
-    std::string getSocialMedia() const { return socialMedia; }
+    const std::string& getName() const { return name; }
+    const std::string& getPhone() const { return phone; }
+    const std::string& getEmail() const { return email; }
+    const std::string& getAddress() const { return address; }
+    const std::string& getNotes() const { return notes; }
+    const std::string& getCompany() const { return company; }
+    const std::string& getJobTitle() const { return jobTitle; }
+    const std::string& getBirthday() const { return birthday; }
+    const BirthDate& getBirthDate() const { return birthDate; }
+    const std::string& getWebsite() const { return website; }
+    const std::vector<std::string>& getTags() const { return tags; }
+    const std::string& getSocialMedia() const { return socialMedia; }
     std::time_t getCreatedDate() const { return createdDate; }
     std::time_t getModifiedDate() const { return modifiedDate; }
     bool getIsFavorite() const { return isFavorite; }
     int getContactId() const { return contactId; }
 
+    // Case-folded getters for searching
+    const std::string& getFoldedName() const { return folded.name; }
+    const std::string& getFoldedEmail() const { return folded.email; }
+    const std::string& getFoldedCompany() const { return folded.company; }
+    const std::string& getFoldedAddress() const { return folded.address; }
+    const std::string& getFoldedNotes() const { return folded.notes; }
+    const std::string& getFoldedJobTitle() const { return folded.jobTitle; }
+    const std::string& getFoldedWebsite() const { return folded.website; }
+    const std::string& getFoldedSocialMedia() const { return folded.socialMedia; }
+
     // Setters
-    void setName(const std::string& name) { this->name = name; updateModifiedDate(); }
+    void setName(const std::string& name) { this->name = name; folded.name = foldCase(name); updateModifiedDate(); }
     void setPhone(const std::string& phone) { this->phone = phone; updateModifiedDate(); }
-    void setEmail(const std::string& email) { this->email = email; updateModifiedDate(); }
-    void setAddress(const std::string& address) { this->address = address; updateModifiedDate(); }
-    void setNotes(const std::string& notes) { this->notes = notes; updateModifiedDate(); }
-    void setCompany(const std::string& company) { this->company = company; updateModifiedDate(); }
-    void setJobTitle(const std::string& jobTitle) { this->jobTitle = jobTitle; updateModifiedDate(); }
-    void setBirthday(const std::string& birthday) { this->birthday = birthday; updateModifiedDate(); }
-    void setWebsite(const std::string& website) { this->website = website; updateModifiedDate(); }
-    void setSocialMedia(const std::string& socialMedia) { this->socialMedia = socialMedia; updateModifiedDate(); }
+    void setEmail(const std::string& email) { this->email = email; folded.email = foldCase(email); updateModifiedDate(); }
+    void setAddress(const std::string& address) { this->address = address; folded.address = foldCase(address); updateModifiedDate(); }
+    void setNotes(const std::string& notes) { this->notes = notes; folded.notes = foldCase(notes); updateModifiedDate(); }
+    void setCompany(const std::string& company) { this->company = company; folded.company = foldCase(company); updateModifiedDate(); }
+    void setJobTitle(const std::string& jobTitle) { this->jobTitle = jobTitle; folded.jobTitle = foldCase(jobTitle); updateModifiedDate(); }
+    void setBirthday(const std::string& birthday) { this->birthday = birthday; birthDate = BirthDate::parse(birthday); updateModifiedDate(); }
+    void setWebsite(const std::string& website) { this->website = website; folded.website = foldCase(website); updateModifiedDate(); }
+    void setSocialMedia(const std::string& socialMedia) { this->socialMedia = socialMedia; folded.socialMedia = foldCase(socialMedia); updateModifiedDate(); }
     void setIsFavorite(bool favorite) { isFavorite = favorite; updateModifiedDate(); }
     
     void addTag(const std::string& tag) {
         if (std::find(tags.begin(), tags.end(), tag) == tags.end()) {
             tags.push_back(tag);
+            folded.tags.push_back(foldCase(tag));
             updateModifiedDate();
         }
     }
     
     void removeTag(const std::string& tag) {
-        tags.erase(std::remove(tags.begin(), tags.end(), tag), tags.end());
+        for (size_t i = tags.size(); i-- > 0; ) {
+            if (tags[i] == tag) {
+                tags.erase(tags.begin() + i);
+                folded.tags.erase(folded.tags.begin() + i);
+            }
+        }
         updateModifiedDate();
     }
 
@@ -299,40 +1153,56 @@ public:
                   << (isFavorite ? "★" : " ") << std::endl;
     }
 
+    // Whole years since the birthday, -1 without a valid one
     int getAge() const {
-        if (birthday.empty()) return -1;
-        
-        std::tm tm = {};
-        std::istringstream ss(birthday);
-        ss >> std::get_time(&tm, "%Y-%m-%d");
-        if (ss.fail()) return -1;
+        if (!birthDate.isSet()) return -1;
         
-        auto birthTime = std::mktime(&tm);
         auto now = std::time(nullptr);
-        
-        int age = std::difftime(now, birthTime) / (60 * 60 * 24 * 365.25);
+        std::tm today = *std::localtime(&now);
+        int age = today.tm_year + 1900 - birthDate.year;
+        if (today.tm_mon + 1 < birthDate.month ||
+            (today.tm_mon + 1 == birthDate.month && today.tm_mday < birthDate.day)) {
+            --age;
+        }
         return age;
     }
 
     bool matchesSearch(const std::string& query) const {
-        std::string searchQuery = query;
-        std::transform(searchQuery.begin(), searchQuery.end(), searchQuery.begin(), ::tolower);
-        
+        return matchesFolded(foldCase(query));
+    }
+
+    // Like matchesSearch, for a query the caller has already folded
+    bool matchesFolded(const std::string& foldedQuery) const {
         auto checkField = [&](const std::string& field) {
-            std::string fieldLower = field;
-            std::transform(fieldLower.begin(), fieldLower.end(), fieldLower.begin(), ::tolower);
-            return fieldLower.find(searchQuery) != std::string::npos;
+            return field.find(foldedQuery) != std::string::npos;
         };
         
-        return checkField(name) || checkField(phone) || checkField(email) || 
-               checkField(address) || checkField(company) || checkField(jobTitle) ||
-               checkField(notes) || checkField(website) || checkField(socialMedia) ||
-               std::any_of(tags.begin(), tags.end(), [&](const std::string& tag) {
-                   return checkField(tag);
-               });
+        return checkField(folded.name) || checkField(phone) || checkField(folded.email) || 
+               checkField(folded.address) || checkField(folded.company) || checkField(folded.jobTitle) ||
+               checkField(folded.notes) || checkField(folded.website) || checkField(folded.socialMedia) ||
+               std::any_of(folded.tags.begin(), folded.tags.end(), checkField);
     }
 
-    friend std::ostream& operator<<(std::ostream& os, const Contact& contact) {
+    // Appends every field matchesFolded looks at, each followed by a NUL,
+    // so a packed scan sees the same text and no match spans two fields
+    void appendSearchText(std::string& out) const {
+        auto field = [&out](const std::string& text) {
+            out += text;
+            out.push_back('\0');
+        };
+        field(folded.name);
+        field(phone);
+        field(folded.email);
+        field(folded.address);
+        field(folded.company);
+        field(folded.jobTitle);
+        field(folded.notes);
+        field(folded.website);
+        field(folded.socialMedia);
+        for (const auto& tag : folded.tags) field(tag);
+    }
+
+    friend std::ostream& operator<<(std::ostream& os, const Contact& contact) {
         os << contact.contactId << "\n" << contact.name << "\n" << contact.phone << "\n" 
            << contact.email << "\n" << contact.address << "\n" << contact.company << "\n"
            << contact.jobTitle << "\n" << contact.birthday << "\n" << contact.website << "\n"
@@ -365,20 +1235,20 @@ public:
         is >> contact.modifiedDate;
         
         // Load tags
-        size_t tagCount;
+        size_t tagCount = 0;
         is >> tagCount;
         is.ignore();
         contact.tags.clear();
-        for (size_t i = 0; i < tagCount; ++i) {
+        for (size_t i = 0; i < tagCount && is; ++i) {
             std::string tag;
             std::getline(is, tag);
             contact.tags.push_back(tag);
         }
         
+        contact.refold();
+        
         // Update nextId
-        if (contact.contactId >= Contact::nextId) {
-            Contact::nextId = contact.contactId + 1;
-        }
+        Contact::raiseNextId(contact.contactId);
         
         return is;
     }
@@ -392,146 +1262,4769 @@ public:
     }
 };
 
-int Contact::nextId = 1;
+std::atomic<int> Contact::nextId(1);
 
-class Statistics {
+// Binary encoding of a single contact, shared by the snapshot file. Layout:
+//   i32 id, u8 favorite, i64 created, i64 modified,
+//   10 length-prefixed strings (name .. notes), u32 tag count, tags
+class ContactCodec {
 private:
-    std::map<std::string, int> tagCounts;
-    std::map<std::string, int> companyCounts;
-    int totalContacts;
-    int favoritesCount;
-    
+    static bool readString(const char*& p, const char* end, std::string& out) {
+        if (end - p < 4) return false;
+        uint32_t length = BinaryCodec::getU32(p);
+        p += 4;
+        if (static_cast<size_t>(end - p) < length) return false;
+        out.assign(p, length);
+        p += length;
+        return true;
+    }
+
 public:
-    Statistics() : totalContacts(0), favoritesCount(0) {}
-    
-    void update(const std::vector<Contact>& contacts) {
-        totalContacts = contacts.size();
-        tagCounts.clear();
-        companyCounts.clear();
-        favoritesCount = 0;
-        
+    static void encode(const Contact& contact, std::string& out) {
+        BinaryCodec::putU32(out, static_cast<uint32_t>(contact.contactId));
+        out.push_back(contact.isFavorite ? 1 : 0);
+        BinaryCodec::putU64(out, static_cast<uint64_t>(contact.createdDate));
+        BinaryCodec::putU64(out, static_cast<uint64_t>(contact.modifiedDate));
+        BinaryCodec::putString(out, contact.name);
+        BinaryCodec::putString(out, contact.phone);
+        BinaryCodec::putString(out, contact.email);
+        BinaryCodec::putString(out, contact.address);
+        BinaryCodec::putString(out, contact.company);
+        BinaryCodec::putString(out, contact.jobTitle);
+        BinaryCodec::putString(out, contact.birthday);
+        BinaryCodec::putString(out, contact.website);
+        BinaryCodec::putString(out, contact.socialMedia);
+        BinaryCodec::putString(out, contact.notes);
+        BinaryCodec::putU32(out, static_cast<uint32_t>(contact.tags.size()));
+        for (const auto& tag : contact.tags) {
+            BinaryCodec::putString(out, tag);
+        }
+    }
+
+    // Returns false if the record is truncated or malformed.
+    static bool decode(const char* data, size_t length, Contact& contact) {
+        const char* p = data;
+        const char* end = data + length;
+        if (length < 21) return false;
+
+        contact.contactId = static_cast<int>(BinaryCodec::getU32(p));
+        contact.isFavorite = p[4] != 0;
+        contact.createdDate = static_cast<std::time_t>(BinaryCodec::getU64(p + 5));
+        contact.modifiedDate = static_cast<std::time_t>(BinaryCodec::getU64(p + 13));
+        p += 21;
+
+        if (!readString(p, end, contact.name) || !readString(p, end, contact.phone) ||
+            !readString(p, end, contact.email) || !readString(p, end, contact.address) ||
+            !readString(p, end, contact.company) || !readString(p, end, contact.jobTitle) ||
+            !readString(p, end, contact.birthday) || !readString(p, end, contact.website) ||
+            !readString(p, end, contact.socialMedia) || !readString(p, end, contact.notes)) {
+            return false;
+        }
+
+        if (end - p < 4) return false;
+        uint32_t tagCount = BinaryCodec::getU32(p);
+        p += 4;
+        contact.tags.clear();
+        contact.tags.reserve(tagCount);
+        for (uint32_t i = 0; i < tagCount; ++i) {
+            std::string tag;
+            if (!readString(p, end, tag)) return false;
+            contact.tags.push_back(std::move(tag));
+        }
+        contact.refold();
+        return true;
+    }
+
+    static Contact makeEmpty(int contactId) {
+        return Contact(contactId);
+    }
+
+    static void reserveId(int contactId) {
+        Contact::raiseNextId(contactId);
+    }
+
+    // Restores a timestamp after replaying a mutation whose setter stamped
+    // the current time
+    static void setModifiedDate(Contact& contact, std::time_t modified) {
+        contact.modifiedDate = modified;
+    }
+};
+
+// Parser for the legacy text format written by operator<<, working over an
+// already decrypted contiguous buffer. Each record is 14 field lines, a tag
+// count line and that many tag lines. Lines are found with memchr, numbers
+// are parsed by hand rather than through locale-aware stream extraction, and
+// fields are assigned straight from the buffer, so the only allocations are
+// the strings too long for the small-string buffer.
+class TextRecordParser {
+private:
+    static const size_t kFieldLines = 14;
+
+    static bool nextLine(const char*& p, const char* end, const char*& line, size_t& length) {
+        if (p >= end) return false;
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!newline) return false;
+        line = p;
+        length = newline - p;
+        p = newline + 1;
+        return true;
+    }
+
+    static bool parseInt(const char* p, size_t length, int64_t& value) {
+        const char* end = p + length;
+        bool negative = p < end && *p == '-';
+        if (negative) ++p;
+        if (p == end) return false;
+        uint64_t magnitude = 0;
+        for (; p < end; ++p) {
+            unsigned digit = static_cast<unsigned char>(*p) - '0';
+            if (digit > 9 || magnitude > (UINT64_MAX - digit) / 10) return false;
+            magnitude = magnitude * 10 + digit;
+        }
+        value = negative ? -static_cast<int64_t>(magnitude) : static_cast<int64_t>(magnitude);
+        return true;
+    }
+
+    static bool intLine(const char*& p, const char* end, int64_t& value) {
+        const char* line;
+        size_t length;
+        return nextLine(p, end, line, length) && parseInt(line, length, value);
+    }
+
+    static bool stringLine(const char*& p, const char* end, std::string& out) {
+        const char* line;
+        size_t length;
+        if (!nextLine(p, end, line, length)) return false;
+        out.assign(line, length);
+        return true;
+    }
+
+public:
+    // Parses one record starting at p and advances p past it. Returns false
+    // if the record is truncated or malformed.
+    static bool parse(const char*& p, const char* end, Contact& contact) {
+        int64_t id, favorite, created, modified, tagCount;
+        if (!intLine(p, end, id) ||
+            !stringLine(p, end, contact.name) || !stringLine(p, end, contact.phone) ||
+            !stringLine(p, end, contact.email) || !stringLine(p, end, contact.address) ||
+            !stringLine(p, end, contact.company) || !stringLine(p, end, contact.jobTitle) ||
+            !stringLine(p, end, contact.birthday) || !stringLine(p, end, contact.website) ||
+            !stringLine(p, end, contact.socialMedia) || !stringLine(p, end, contact.notes) ||
+            !intLine(p, end, favorite) || !intLine(p, end, created) ||
+            !intLine(p, end, modified) || !intLine(p, end, tagCount)) {
+            return false;
+        }
+        if ((favorite != 0 && favorite != 1) || tagCount < 0) return false;
+
+        contact.contactId = static_cast<int>(id);
+        contact.isFavorite = favorite != 0;
+        contact.createdDate = static_cast<std::time_t>(created);
+        contact.modifiedDate = static_cast<std::time_t>(modified);
+        contact.tags.clear();
+        contact.tags.reserve(static_cast<size_t>(std::min<int64_t>(tagCount, end - p)));
+        for (int64_t i = 0; i < tagCount; ++i) {
+            contact.tags.emplace_back();
+            if (!stringLine(p, end, contact.tags.back())) return false;
+        }
+        contact.refold();
+        Contact::raiseNextId(contact.contactId);
+        return true;
+    }
+
+    // Advances p past one record without building it, for splitting a file
+    // into ranges that can be parsed independently
+    static bool skip(const char*& p, const char* end) {
+        const char* line;
+        size_t length;
+        for (size_t i = 0; i < kFieldLines; ++i) {
+            if (!nextLine(p, end, line, length)) return false;
+        }
+        int64_t tagCount;
+        if (!intLine(p, end, tagCount) || tagCount < 0) return false;
+        for (int64_t i = 0; i < tagCount; ++i) {
+            if (!nextLine(p, end, line, length)) return false;
+        }
+        return true;
+    }
+};
+
+// Versioned binary snapshot of the whole contact list. Layout (little-endian):
+//   header  : 64 bytes, see below
+//   records : u32 body length + body, body XOR-encrypted from its own start
+//   offsets : one u64 file offset per record
+//   indexes : optional, XOR-encrypted from its own start, present when the
+//             header has kFlagIndexes; see encodeIndexes
+// With kFlagCompressed, records are grouped into blocks of about 64 KiB.
+// Each block holds the same u32 length + body records, unencrypted, run
+// through BlockCompressor and then XOR-encrypted from the block's start,
+// and the offset table has one entry per block instead (see kBlockEntrySize).
+// The header records the last journal sequence number folded into the
+// snapshot so that journal replay can skip mutations it already contains.
+// Compressed snapshots are written as version 2 so that readers from before
+// compression, which only accept version 1, refuse them; uncompressed ones
+// stay at version 1, whose readers skip the trailing index section. Readers
+// reject flag bits they do not know.
+// The text format written by older versions is still accepted by
+// ContactManager::loadFromFile and is migrated on the next save.
+class SnapshotFile {
+public:
+    static const char* magic() { return "CMSSNAP\0"; }
+    static const uint32_t kVersion = 2;
+    static const uint32_t kPlainVersion = 1; // uncompressed records
+    static const size_t kHeaderSize = 64;
+    static const uint32_t kFlagIndexes = 1;
+    static const uint32_t kFlagCompressed = 2;
+    static const uint32_t kKnownFlags = kFlagIndexes | kFlagCompressed;
+    // Block table entry: u64 file offset, u32 first record, u32 record
+    // count, u32 uncompressed length, u32 stored length
+    static const size_t kBlockEntrySize = 24;
+    static const size_t kTargetBlockSize = 64 * 1024;
+
+    // Header fields after the 8-byte magic
+    struct Header {
+        uint32_t version;
+        uint32_t flags;
+        uint64_t recordCount;
+        uint64_t offsetTableOffset;
+        uint64_t journalSequence;
+        uint64_t indexOffset;
+        uint64_t indexLength;
+        uint32_t indexChecksum;
+        uint32_t blockCount;
+    };
+
+    // The id ordering and tag membership, as ordinals into the record
+    // list. The id ordering lets readContactById find one record without
+    // decoding the others; the tag lists fill the tag bitmaps without
+    // walking every contact's tags.
+    struct Indexes {
+        std::vector<uint32_t> byId; // one ordinal per distinct id, in id order
+        std::vector<std::pair<std::string, std::vector<uint32_t>>> tags; // ordinals in record order
+    };
+
+    // One ordinal per distinct key, in key order. Used for ids, where it
+    // matches buildIndex: when an id repeats, the last record holding it
+    // wins. (Phone keys go to the first holder, but phones are not saved.)
+    template <typename ContactList, typename Key>
+    static std::vector<uint32_t> orderBy(const ContactList& contacts, Key key) {
+        std::vector<uint32_t> order(contacts.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = static_cast<uint32_t>(i);
+        std::stable_sort(order.begin(), order.end(), [&contacts, &key](uint32_t a, uint32_t b) {
+            return key(contacts[a]) < key(contacts[b]);
+        });
+        std::vector<uint32_t> unique;
+        unique.reserve(order.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (i + 1 < order.size() && !(key(contacts[order[i]]) < key(contacts[order[i + 1]]))) continue;
+            unique.push_back(order[i]);
+        }
+        return unique;
+    }
+
+    // Section layout: u64 record count and u64 journal sequence (the
+    // generation, checked against the header), then a u32 0 where older
+    // sections stored a phone ordering, u32 count + (i32 id, u32 ordinal)
+    // pairs for ids, then u32 tag count and per tag its string, u32 count
+    // and ordinals. The ids are stored so that readContactById can binary
+    // search them in place. Phones are not stored: the phone table is a
+    // hash table keyed by digits, so a saved ordering saves no work.
+    template <typename ContactList>
+    static void encodeIndexes(const ContactList& contacts, uint64_t journalSequence, std::string& out) {
+        BinaryCodec::putU64(out, contacts.size());
+        BinaryCodec::putU64(out, journalSequence);
+
+        BinaryCodec::putU32(out, 0);
+
+        std::vector<uint32_t> byId = orderBy(contacts, [](const Contact& c) { return c.getContactId(); });
+        BinaryCodec::putU32(out, static_cast<uint32_t>(byId.size()));
+        for (uint32_t ordinal : byId) {
+            BinaryCodec::putU32(out, static_cast<uint32_t>(contacts[ordinal].getContactId()));
+            BinaryCodec::putU32(out, ordinal);
+        }
+
+        std::map<std::string, std::vector<uint32_t>> tags;
+        for (size_t i = 0; i < contacts.size(); ++i) {
+            for (const auto& tag : contacts[i].getTags()) {
+                tags[tag].push_back(static_cast<uint32_t>(i));
+            }
+        }
+        BinaryCodec::putU32(out, static_cast<uint32_t>(tags.size()));
+        for (const auto& entry : tags) {
+            BinaryCodec::putString(out, entry.first);
+            BinaryCodec::putU32(out, static_cast<uint32_t>(entry.second.size()));
+            for (uint32_t ordinal : entry.second) BinaryCodec::putU32(out, ordinal);
+        }
+    }
+
+    static bool isSnapshot(const char* data, size_t length) {
+        return length >= kHeaderSize && std::memcmp(data, magic(), 8) == 0;
+    }
+
+    // Appends one u32 length + body record to out
+    static void appendRecord(const Contact& contact, std::string& out) {
+        size_t start = out.size();
+        BinaryCodec::putU32(out, 0);
+        ContactCodec::encode(contact, out);
+        uint32_t bodyLength = static_cast<uint32_t>(out.size() - start - 4);
+        for (int i = 0; i < 4; ++i) out[start + i] = static_cast<char>((bodyLength >> (8 * i)) & 0xFF);
+    }
+
+    template <typename ContactList>
+    static void writeRecords(BlockWriter& file, const ContactList& contacts, const SimpleEncryption& encryptor) {
+        std::vector<uint64_t> offsets;
+        offsets.reserve(contacts.size());
+        std::string record;
         for (const auto& contact : contacts) {
-            if (contact.getIsFavorite()) {
-                favoritesCount++;
+            record.clear();
+            appendRecord(contact, record);
+            encryptor.applyInPlace(&record[4], record.size() - 4);
+
+            offsets.push_back(file.tell());
+            file.append(record.data(), record.size());
+        }
+
+        std::string table;
+        for (uint64_t offset : offsets) {
+            BinaryCodec::putU64(table, offset);
+            if (table.size() >= SimpleEncryption::kBlockSize) {
+                file.append(table.data(), table.size());
+                table.clear();
             }
-            
-            if (!contact.getCompany().empty()) {
-                companyCounts[contact.getCompany()]++;
+        }
+        file.append(table.data(), table.size());
+    }
+
+    // Returns the number of blocks written
+    template <typename ContactList>
+    static uint32_t writeBlocks(BlockWriter& file, const ContactList& contacts,
+                                const SimpleEncryption& encryptor, std::string& table) {
+        std::string raw;
+        std::string compressed;
+        uint32_t firstRecord = 0;
+        uint32_t blockCount = 0;
+        for (size_t i = 0; i < contacts.size(); ++i) {
+            appendRecord(contacts[i], raw);
+            if (raw.size() < kTargetBlockSize && i + 1 < contacts.size()) continue;
+
+            compressed.clear();
+            BlockCompressor::compress(raw.data(), raw.size(), compressed);
+            encryptor.applyInPlace(&compressed[0], compressed.size());
+
+            uint32_t recordCount = static_cast<uint32_t>(i + 1 - firstRecord);
+            BinaryCodec::putU64(table, file.tell());
+            BinaryCodec::putU32(table, firstRecord);
+            BinaryCodec::putU32(table, recordCount);
+            BinaryCodec::putU32(table, static_cast<uint32_t>(raw.size()));
+            BinaryCodec::putU32(table, static_cast<uint32_t>(compressed.size()));
+            file.append(compressed.data(), compressed.size());
+
+            firstRecord += recordCount;
+            ++blockCount;
+            raw.clear();
+        }
+        return blockCount;
+    }
+
+    // ContactList is any sequence with size() and operator[] in list order:
+    // a plain vector, or the manager's ContactSlotMap
+    template <typename ContactList>
+    static bool write(const std::string& path, const ContactList& contacts,
+                      const SimpleEncryption& encryptor, uint64_t journalSequence,
+                      bool compress = false) {
+        std::string tempPath = path + ".tmp";
+        BlockWriter file;
+        if (!file.open(tempPath)) {
+            return false;
+        }
+
+        file.append(std::string(kHeaderSize, '\0').data(), kHeaderSize);
+
+        uint64_t position;
+        uint32_t blockCount = 0;
+        if (compress) {
+            std::string table;
+            blockCount = writeBlocks(file, contacts, encryptor, table);
+            position = file.tell();
+            file.append(table.data(), table.size());
+        } else {
+            writeRecords(file, contacts, encryptor);
+            position = file.tell() - contacts.size() * 8;
+        }
+
+        uint64_t indexOffset = file.tell();
+        std::string indexes;
+        encodeIndexes(contacts, journalSequence, indexes);
+        encryptor.applyInPlace(&indexes[0], indexes.size());
+        file.append(indexes.data(), indexes.size());
+
+        std::string header(magic(), 8);
+        BinaryCodec::putU32(header, compress ? kVersion : kPlainVersion);
+        BinaryCodec::putU32(header, kFlagIndexes | (compress ? kFlagCompressed : 0));
+        BinaryCodec::putU64(header, contacts.size());
+        BinaryCodec::putU64(header, position);
+        BinaryCodec::putU64(header, journalSequence);
+        BinaryCodec::putU64(header, indexOffset);
+        BinaryCodec::putU64(header, indexes.size());
+        BinaryCodec::putU32(header, BinaryCodec::checksum(indexes.data(), indexes.size()));
+        BinaryCodec::putU32(header, blockCount);
+        bool ok = file.finish() && file.patch(0, header.data(), header.size());
+        if (!file.close() || !ok) {
+            std::remove(tempPath.c_str());
+            return false;
+        }
+
+#ifdef _WIN32
+        std::remove(path.c_str());
+#endif
+        return std::rename(tempPath.c_str(), path.c_str()) == 0;
+    }
+
+    static bool readHeader(const char* data, size_t length, Header& header) {
+        if (!isSnapshot(data, length)) return false;
+        header.version = BinaryCodec::getU32(data + 8);
+        header.flags = BinaryCodec::getU32(data + 12);
+        header.recordCount = BinaryCodec::getU64(data + 16);
+        header.offsetTableOffset = BinaryCodec::getU64(data + 24);
+        header.journalSequence = BinaryCodec::getU64(data + 32);
+        header.indexOffset = BinaryCodec::getU64(data + 40);
+        header.indexLength = BinaryCodec::getU64(data + 48);
+        header.indexChecksum = BinaryCodec::getU32(data + 56);
+        header.blockCount = BinaryCodec::getU32(data + 60);
+        if (header.version != kVersion && header.version != kPlainVersion) return false;
+        if ((header.flags & ~kKnownFlags) != 0) return false;
+        if (header.version == kPlainVersion && (header.flags & kFlagCompressed)) return false;
+        if (header.offsetTableOffset > length) return false;
+        if (header.flags & kFlagCompressed) {
+            return (length - header.offsetTableOffset) / kBlockEntrySize >= header.blockCount;
+        }
+        return (length - header.offsetTableOffset) / 8 >= header.recordCount;
+    }
+
+    // Reads the persisted indexes. Returns false if the snapshot has none or
+    // they fail the checksum, generation or bounds checks; the caller then
+    // rebuilds them from the records.
+    static bool readIndexes(const char* data, size_t length, const Header& header,
+                            const SimpleEncryption& encryptor, Indexes& out) {
+        if (!(header.flags & kFlagIndexes) || header.indexOffset > length ||
+            header.indexLength > length - header.indexOffset || header.indexLength < 28) {
+            return false;
+        }
+        const char* stored = data + header.indexOffset;
+        if (BinaryCodec::checksum(stored, header.indexLength) != header.indexChecksum) return false;
+
+        std::string section(stored, header.indexLength);
+        encryptor.applyInPlace(&section[0], section.size());
+        const char* p = section.data();
+        const char* end = p + section.size();
+        if (BinaryCodec::getU64(p) != header.recordCount || BinaryCodec::getU64(p + 8) != header.journalSequence) {
+            return false;
+        }
+        p += 16;
+
+        // Entries are stride bytes wide and end with the ordinal
+        auto readOrdinals = [&p, end, &header](std::vector<uint32_t>& ordinals, size_t stride) {
+            if (end - p < 4) return false;
+            uint32_t count = BinaryCodec::getU32(p);
+            p += 4;
+            if (count > header.recordCount || static_cast<size_t>(end - p) / stride < count) return false;
+            ordinals.resize(count);
+            for (uint32_t i = 0; i < count; ++i, p += stride) {
+                ordinals[i] = BinaryCodec::getU32(p + stride - 4);
+                if (ordinals[i] >= header.recordCount) return false;
             }
-            
-            for (const auto& tag : contact.getTags()) {
-                tagCounts[tag]++;
+            return true;
+        };
+        // A section from before phones were dropped is rebuilt, not adopted
+        if (BinaryCodec::getU32(p) != 0) return false;
+        p += 4;
+        if (!readOrdinals(out.byId, 8) || end - p < 4) return false;
+
+        uint32_t tagCount = BinaryCodec::getU32(p);
+        p += 4;
+        out.tags.clear();
+        out.tags.reserve(std::min<size_t>(tagCount, (end - p) / 8));
+        for (uint32_t i = 0; i < tagCount; ++i) {
+            if (end - p < 4) return false;
+            uint32_t tagLength = BinaryCodec::getU32(p);
+            p += 4;
+            if (static_cast<size_t>(end - p) < tagLength) return false;
+            out.tags.emplace_back(std::string(p, tagLength), std::vector<uint32_t>());
+            p += tagLength;
+            if (!readOrdinals(out.tags.back().second, 4)) return false;
+        }
+        return p == end;
+    }
+
+    // Decodes records [first, last) of an uncompressed snapshot into out.
+    static bool readRecords(const char* data, const Header& header, size_t first, size_t last,
+                            const SimpleEncryption& encryptor, std::vector<Contact>& out) {
+        const char* table = data + header.offsetTableOffset;
+        std::string body;
+        for (size_t i = first; i < last; ++i) {
+            uint64_t offset = BinaryCodec::getU64(table + i * 8);
+            if (offset > header.offsetTableOffset || header.offsetTableOffset - offset < 4) return false;
+            uint32_t bodyLength = BinaryCodec::getU32(data + offset);
+            if (bodyLength > header.offsetTableOffset - offset - 4) return false;
+
+            body.assign(data + offset + 4, bodyLength);
+            encryptor.applyInPlace(&body[0], body.size());
+
+            Contact contact = ContactCodec::makeEmpty(0);
+            if (!ContactCodec::decode(body.data(), body.size(), contact)) return false;
+            out.push_back(std::move(contact));
+        }
+        return true;
+    }
+
+    // Decrypts and decompresses one block into raw, returning its first
+    // record and record count
+    static bool readBlock(const char* data, const Header& header, size_t block,
+                          const SimpleEncryption& encryptor, std::string& stored, std::string& raw,
+                          uint32_t& firstRecord, uint32_t& recordCount) {
+        const char* entry = data + header.offsetTableOffset + block * kBlockEntrySize;
+        uint64_t offset = BinaryCodec::getU64(entry);
+        firstRecord = BinaryCodec::getU32(entry + 8);
+        recordCount = BinaryCodec::getU32(entry + 12);
+        uint32_t rawLength = BinaryCodec::getU32(entry + 16);
+        uint32_t storedLength = BinaryCodec::getU32(entry + 20);
+        if (offset > header.offsetTableOffset || storedLength > header.offsetTableOffset - offset) return false;
+        // No sequence expands to more than 255 times its encoded size
+        if (rawLength / 255 > storedLength) return false;
+
+        stored.assign(data + offset, storedLength);
+        encryptor.applyInPlace(&stored[0], stored.size());
+        raw.resize(rawLength);
+        return BlockCompressor::decompress(stored.data(), stored.size(), &raw[0], raw.size());
+    }
+
+    // Decodes records [skip, skip + count) of a decompressed block into out
+    static bool decodeBlockRecords(const std::string& raw, uint32_t skip, uint32_t count,
+                                   std::vector<Contact>& out) {
+        const char* p = raw.data();
+        const char* end = p + raw.size();
+        for (uint32_t i = 0; i < skip + count; ++i) {
+            if (end - p < 4) return false;
+            uint32_t bodyLength = BinaryCodec::getU32(p);
+            p += 4;
+            if (static_cast<size_t>(end - p) < bodyLength) return false;
+            if (i >= skip) {
+                Contact contact = ContactCodec::makeEmpty(0);
+                if (!ContactCodec::decode(p, bodyLength, contact)) return false;
+                out.push_back(std::move(contact));
             }
+            p += bodyLength;
         }
+        return true;
     }
-    
-    void display() const {
-        std::cout << "\n=== STATISTICS ===\n";
-        std::cout << "Total Contacts: " << totalContacts << std::endl;
-        std::cout << "Favorites: " << favoritesCount << std::endl;
-        
-        if (!companyCounts.empty()) {
-            std::cout << "\nCompanies:\n";
-            for (const auto& entry : companyCounts) {
-                std::cout << "  " << entry.first << ": " << entry.second << std::endl;
+
+    // Number of independently decodable parts: records, or blocks in a
+    // compressed snapshot
+    static size_t partCount(const Header& header) {
+        return (header.flags & kFlagCompressed) ? header.blockCount : header.recordCount;
+    }
+
+    // Decodes parts [first, last) of a mapped snapshot into out.
+    static bool readParts(const char* data, const Header& header, size_t first, size_t last,
+                          const SimpleEncryption& encryptor, std::vector<Contact>& out) {
+        if (!(header.flags & kFlagCompressed)) {
+            return readRecords(data, header, first, last, encryptor, out);
+        }
+        std::string stored;
+        std::string raw;
+        for (size_t block = first; block < last; ++block) {
+            uint32_t firstRecord;
+            uint32_t recordCount;
+            if (!readBlock(data, header, block, encryptor, stored, raw, firstRecord, recordCount) ||
+                !decodeBlockRecords(raw, 0, recordCount, out)) {
+                return false;
             }
         }
-        
-        if (!tagCounts.empty()) {
-            std::cout << "\nTags:\n";
-            for (const auto& entry : tagCounts) {
-                std::cout << "  " << entry.first << ": " << entry.second << std::endl;
+        return true;
+    }
+
+    // Reads a single contact by binary searching the persisted id ordering,
+    // decoding only the record (or block) that holds it. Returns false if
+    // the id is absent or the snapshot has no usable index section.
+    static bool readContactById(const char* data, size_t length, const Header& header,
+                                const SimpleEncryption& encryptor, int contactId, Contact& out) {
+        if (!(header.flags & kFlagIndexes) || header.indexOffset > length ||
+            header.indexLength > length - header.indexOffset) {
+            return false;
+        }
+        const char* section = data + header.indexOffset;
+        auto sectionU32 = [section, &header, &encryptor](uint64_t at, uint32_t& value) {
+            if (at + 4 > header.indexLength) return false;
+            char bytes[4];
+            std::memcpy(bytes, section + at, 4);
+            encryptor.applyInPlace(bytes, 4, at);
+            value = BinaryCodec::getU32(bytes);
+            return true;
+        };
+
+        uint32_t phoneCount;
+        uint32_t idCount;
+        if (!sectionU32(16, phoneCount)) return false;
+        uint64_t idsAt = 20 + uint64_t(phoneCount) * 4;
+        if (!sectionU32(idsAt, idCount)) return false;
+
+        size_t low = 0;
+        size_t high = idCount;
+        uint32_t ordinal = 0;
+        bool found = false;
+        while (low < high && !found) {
+            size_t middle = low + (high - low) / 2;
+            uint32_t id;
+            if (!sectionU32(idsAt + 4 + middle * 8, id)) return false;
+            if (static_cast<int>(id) == contactId) {
+                found = sectionU32(idsAt + 8 + middle * 8, ordinal);
+                if (!found) return false;
+            } else if (static_cast<int>(id) < contactId) {
+                low = middle + 1;
+            } else {
+                high = middle;
             }
         }
+        if (!found || ordinal >= header.recordCount) return false;
+
+        std::vector<Contact> decoded;
+        if (!(header.flags & kFlagCompressed)) {
+            if (!readRecords(data, header, ordinal, ordinal + 1, encryptor, decoded)) return false;
+        } else {
+            // Last block whose first record is at or before the ordinal
+            size_t first = 0;
+            size_t last = header.blockCount;
+            while (last - first > 1) {
+                size_t middle = first + (last - first) / 2;
+                const char* entry = data + header.offsetTableOffset + middle * kBlockEntrySize;
+                if (BinaryCodec::getU32(entry + 8) <= ordinal) first = middle;
+                else last = middle;
+            }
+            std::string stored;
+            std::string raw;
+            uint32_t firstRecord;
+            uint32_t recordCount;
+            if (header.blockCount == 0 ||
+                !readBlock(data, header, first, encryptor, stored, raw, firstRecord, recordCount) ||
+                ordinal < firstRecord || ordinal - firstRecord >= recordCount ||
+                !decodeBlockRecords(raw, ordinal - firstRecord, 1, decoded)) {
+                return false;
+            }
+        }
+        if (decoded.size() != 1 || decoded[0].getContactId() != contactId) return false;
+        out = std::move(decoded[0]);
+        return true;
     }
 };
 
-class ContactManager {
+const uint32_t SnapshotFile::kVersion;
+const uint32_t SnapshotFile::kPlainVersion;
+const uint32_t SnapshotFile::kKnownFlags;
+const size_t SnapshotFile::kHeaderSize;
+const uint32_t SnapshotFile::kFlagIndexes;
+const uint32_t SnapshotFile::kFlagCompressed;
+const size_t SnapshotFile::kBlockEntrySize;
+const size_t SnapshotFile::kTargetBlockSize;
+
+enum class FsyncPolicy {
+    Never,       // leave write-back to the operating system
+    EveryRecord, // fsync after every journal append
+    Periodic     // fsync after every fsyncInterval appends
+};
+
+struct StorageOptions {
+    FsyncPolicy fsyncPolicy;
+    int fsyncInterval;
+    // Compaction starts when the journal grows past either threshold; the
+    // replay estimate uses the throughput measured at the last startup
+    uint64_t compactJournalBytes;
+    int compactReplayMillis;
+    // Write snapshots as compressed blocks; either form is read back
+    bool compressSnapshots;
+
+    StorageOptions()
+        : fsyncPolicy(FsyncPolicy::Periodic), fsyncInterval(16),
+          compactJournalBytes(8 * 1024 * 1024), compactReplayMillis(500),
+          compressSnapshots(false) {}
+};
+
+// Applies journal operations to a contact list loaded from a snapshot
+class JournalReplay {
 private:
-    std::vector<Contact> contacts;
-    std::map<std::string, Contact*> phoneIndex;
-    std::map<int, Contact*> idIndex;
-    std::string filename;
-    Logger logger;
-    SimpleEncryption encryptor;
-    BackupManager backupManager;
-    Statistics stats;
-    std::unordered_map<std::string, std::vector<Contact*>> tagIndex;
-    bool autoBackup;
-    int autoBackupInterval;
-    std::time_t lastBackupTime;
-    
-    void buildIndex() {
-        phoneIndex.clear();
-        idIndex.clear();
-        tagIndex.clear();
-        
-        for (auto& contact : contacts) {
-            phoneIndex[contact.getPhone()] = &contact;
-            idIndex[contact.getContactId()] = &contact;
-            
-            // Build tag index
-            for (const auto& tag : contact.getTags()) {
-                tagIndex[tag].push_back(&contact);
-            }
-        }
+    std::vector<Contact>& contacts;
+    std::unordered_map<int, size_t> positions;
+    std::vector<char> deleted;
+    size_t deletedCount;
+    bool reserveIds;
+
+    Contact* find(int contactId) {
+        auto it = positions.find(contactId);
+        if (it == positions.end() || deleted[it->second]) return nullptr;
+        return &contacts[it->second];
     }
 
-    void saveToFile() {
-        std::ofstream file(filename);
-        if (!file.is_open()) {
-            std::cerr << "Error: Could not save contacts to file!\n";
-            logger.log("Failed to save contacts to file: " + filename, "ERROR");
-            return;
+public:
+    // reserveIds advances Contact::nextId past replayed ids; background
+    // replays pass false since only the owning thread may touch it
+    JournalReplay(std::vector<Contact>& contacts, bool reserveIds)
+        : contacts(contacts), deleted(contacts.size(), 0), deletedCount(0), reserveIds(reserveIds) {
+        for (size_t i = 0; i < contacts.size(); ++i) {
+            positions[contacts[i].getContactId()] = i;
         }
-        
-        // Encrypt data before saving
-        std::stringstream buffer;
-        for (const auto& contact : contacts) {
-            buffer << contact;
+    }
+
+    // Returns false if the payload does not decode
+    bool apply(uint8_t operation, const char* payload, size_t length);
+
+    // Drops contacts deleted during replay, keeping the order of the rest
+    void finish() {
+        if (deletedCount == 0) return;
+        size_t out = 0;
+        for (size_t i = 0; i < contacts.size(); ++i) {
+            if (!deleted[i]) {
+                if (out != i) contacts[out] = std::move(contacts[i]);
+                ++out;
+            }
         }
-        
-        std::string encryptedData = encryptor.encrypt(buffer.str());
-        file << encryptedData;
-        file.close();
-        
-        logger.log("Contacts saved successfully: " + std::to_string(contacts.size()) + " contacts", "INFO");
+        contacts.resize(out);
+        deleted.assign(out, 0);
+        deletedCount = 0;
     }
+};
 
-    void loadFromFile() {
-        std::ifstream file(filename);
-        if (!file.is_open()) {
-            logger.log("No existing contact file found, starting fresh", "INFO");
-            return;
+// Append-only write-ahead log of mutations made since the last snapshot.
+// Record layout (little-endian):
+//   u32 body length, u32 checksum of the stored body,
+//   body = u64 sequence, u8 operation, operation payload
+// The body is XOR-encrypted from its own start like snapshot records.
+class MutationJournal {
+public:
+    enum Operation : uint8_t {
+        AddContact = 1,
+        UpdateContact = 2,
+        DeleteContact = 3,
+        AddTag = 4,
+        RemoveTag = 5,
+        SetFavorite = 6
+    };
+
+private:
+    std::string path;
+    std::FILE* file;
+    const SimpleEncryption* encryptor;
+    StorageOptions options;
+    uint64_t nextSequence;
+    uint64_t recordCount;
+    uint64_t byteCount;
+    int unsyncedRecords;
+    bool lostRecords; // an append failed, so the file no longer holds every change
+    std::string record;
+
+    MutationJournal(const MutationJournal&);
+    MutationJournal& operator=(const MutationJournal&);
+
+    void sync() {
+        std::fflush(file);
+#ifdef _WIN32
+        _commit(_fileno(file));
+#else
+        fsync(fileno(file));
+#endif
+        unsyncedRecords = 0;
+    }
+
+    void beginRecord(Operation operation) {
+        record.clear();
+        BinaryCodec::putU32(record, 0);
+        BinaryCodec::putU32(record, 0);
+        BinaryCodec::putU64(record, nextSequence);
+        record.push_back(static_cast<char>(operation));
+    }
+
+    // A record that is not the last of a batch is written but left for the
+    // batch's last record to sync
+    bool commitRecord(bool lastOfBatch = true) {
+        if (file == nullptr) {
+            lostRecords = true;
+            return false;
         }
-        
-        std::stringstream buffer;
-        buffer << file.rdbuf();
-        file.close();
-        
-        // Decrypt data
-        std::string decryptedData = encryptor.decrypt(buffer.str());
-        std::stringstream decryptedStream(decryptedData);
-        
-        Contact contact;
-        while (decryptedStream >> contact) {
-            contacts.push_back(contact);
+
+        uint32_t bodyLength = static_cast<uint32_t>(record.size() - 8);
+        encryptor->applyInPlace(&record[8], bodyLength);
+        uint32_t sum = BinaryCodec::checksum(&record[8], bodyLength);
+        for (int i = 0; i < 4; ++i) {
+            record[i] = static_cast<char>((bodyLength >> (8 * i)) & 0xFF);
+            record[4 + i] = static_cast<char>((sum >> (8 * i)) & 0xFF);
         }
-        
-        buildIndex();
-        stats.update(contacts);
-        logger.log("Loaded " + std::to_string(contacts.size()) + " contacts from file", "INFO");
-    }
 
-    void displayContacts(const std::vector<Contact>& contactList, bool compact = false) const {
-        if (compact) {
-            std::cout << "\n" << std::setw(4) << "ID" << " | "
-                      << std::setw(20) << std::left << "Name" << " | "
-                      << std::setw(15) << "Phone" << " | "
-                      << std::setw(20) << "Email" << " | "
-                      << "Fav" << std::endl;
-            std::cout << std::string(70, '-') << std::endl;
-            
+        if (std::fwrite(record.data(), 1, record.size(), file) != record.size()) {
+            // Replay stops at the torn record, so later ones are lost too
+            lostRecords = true;
+            return false;
+        }
+        ++nextSequence;
+        ++recordCount;
+        byteCount += record.size();
+        ++unsyncedRecords;
+        if (!lastOfBatch) return true;
+
+        switch (options.fsyncPolicy) {
+            case FsyncPolicy::EveryRecord:
+                sync();
+                break;
+            case FsyncPolicy::Periodic:
+                if (unsyncedRecords >= options.fsyncInterval) sync();
+                else std::fflush(file);
+                break;
+            case FsyncPolicy::Never:
+                std::fflush(file);
+                break;
+        }
+        return true;
+    }
+
+    static void rewritePrefix(const std::string& path, const char* data, size_t length) {
+        std::string tempPath = path + ".tmp";
+        std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+        out.write(data, length);
+        out.close();
+#ifdef _WIN32
+        std::remove(path.c_str());
+#endif
+        std::rename(tempPath.c_str(), path.c_str());
+    }
+
+public:
+    MutationJournal()
+        : file(nullptr), encryptor(nullptr), nextSequence(1), recordCount(0),
+          byteCount(0), unsyncedRecords(0), lostRecords(false) {}
+
+    ~MutationJournal() {
+        close();
+    }
+
+    struct ReplayResult {
+        size_t applied;       // records newer than the snapshot
+        size_t records;       // valid records in the file
+        size_t validBytes;    // length of the valid prefix
+        uint64_t lastSequence;
+    };
+
+    // Applies every record of a journal file with a sequence number above
+    // afterSequence to contacts, stopping at the first torn or corrupt record
+    static ReplayResult replayFile(const std::string& journalPath, const SimpleEncryption& crypt,
+                                   uint64_t afterSequence, std::vector<Contact>& contacts,
+                                   bool reserveIds) {
+        ReplayResult result = { 0, 0, 0, afterSequence };
+        MappedFile mapped;
+        if (!mapped.open(journalPath) || mapped.size() == 0) {
+            return result;
+        }
+
+        const char* data = mapped.begin();
+        size_t size = mapped.size();
+        size_t position = 0;
+        std::string body;
+        JournalReplay replayer(contacts, reserveIds);
+
+        while (size - position >= 8) {
+            uint32_t bodyLength = BinaryCodec::getU32(data + position);
+            uint32_t sum = BinaryCodec::getU32(data + position + 4);
+            if (bodyLength < 9 || bodyLength > size - position - 8) break;
+            if (BinaryCodec::checksum(data + position + 8, bodyLength) != sum) break;
+
+            body.assign(data + position + 8, bodyLength);
+            crypt.applyInPlace(&body[0], body.size());
+            uint64_t sequence = BinaryCodec::getU64(body.data());
+            if (sequence > afterSequence) {
+                if (!replayer.apply(static_cast<uint8_t>(body[8]), body.data() + 9, body.size() - 9)) break;
+                ++result.applied;
+            }
+            if (sequence > result.lastSequence) result.lastSequence = sequence;
+            ++result.records;
+            position += 8 + bodyLength;
+        }
+        replayer.finish();
+        result.validBytes = position;
+        return result;
+    }
+
+    // Replays a journal file into contacts and cuts off a torn tail left by
+    // a crash. Returns the number of records applied.
+    size_t replay(const std::string& journalPath, const SimpleEncryption& crypt,
+                  uint64_t afterSequence, std::vector<Contact>& contacts) {
+        ReplayResult result = replayFile(journalPath, crypt, afterSequence, contacts, true);
+        {
+            MappedFile mapped;
+            if (mapped.open(journalPath) && mapped.size() != result.validBytes) {
+                rewritePrefix(journalPath, mapped.begin(), result.validBytes);
+            }
+        }
+        recordCount = result.records;
+        byteCount = result.validBytes;
+        nextSequence = std::max(nextSequence, result.lastSequence + 1);
+        return result.applied;
+    }
+
+    bool open(const std::string& journalPath, const SimpleEncryption& crypt,
+              const StorageOptions& storageOptions) {
+        close();
+        path = journalPath;
+        encryptor = &crypt;
+        options = storageOptions;
+        file = std::fopen(path.c_str(), "ab");
+        return file != nullptr;
+    }
+
+    void close() {
+        if (file != nullptr) {
+            if (options.fsyncPolicy != FsyncPolicy::Never) sync();
+            std::fclose(file);
+            file = nullptr;
+        }
+    }
+
+    // Moves the current journal aside as segmentPath so it can be folded into
+    // a new snapshot while appends continue into a fresh file
+    bool rotate(const std::string& segmentPath) {
+        if (file == nullptr) return false;
+        sync();
+        std::fclose(file);
+        file = nullptr;
+        bool moved = std::rename(path.c_str(), segmentPath.c_str()) == 0;
+        file = std::fopen(path.c_str(), moved ? "wb" : "ab");
+        if (moved) {
+            recordCount = 0;
+            byteCount = 0;
+        }
+        return moved && file != nullptr;
+    }
+
+    // Empties the journal once a snapshot covering it has been written
+    void reset() {
+        if (file == nullptr) return;
+        std::fclose(file);
+        file = std::fopen(path.c_str(), "wb");
+        recordCount = 0;
+        byteCount = 0;
+        unsyncedRecords = 0;
+        lostRecords = false;
+    }
+
+    bool appendContact(Operation operation, const Contact& contact) {
+        beginRecord(operation);
+        ContactCodec::encode(contact, record);
+        return commitRecord();
+    }
+
+    bool appendDelete(int contactId) {
+        beginRecord(DeleteContact);
+        BinaryCodec::putU32(record, static_cast<uint32_t>(contactId));
+        return commitRecord();
+    }
+    
+    // One delete record per id, synced once for the whole batch
+    bool appendDeletes(const std::vector<int>& contactIds) {
+        bool ok = true;
+        for (size_t i = 0; i < contactIds.size(); ++i) {
+            beginRecord(DeleteContact);
+            BinaryCodec::putU32(record, static_cast<uint32_t>(contactIds[i]));
+            ok = commitRecord(i + 1 == contactIds.size()) && ok;
+        }
+        return ok;
+    }
+
+    bool appendTag(Operation operation, const Contact& contact, const std::string& tag) {
+        beginRecord(operation);
+        BinaryCodec::putU32(record, static_cast<uint32_t>(contact.getContactId()));
+        BinaryCodec::putU64(record, static_cast<uint64_t>(contact.getModifiedDate()));
+        BinaryCodec::putString(record, tag);
+        return commitRecord();
+    }
+
+    bool appendFavorite(const Contact& contact) {
+        beginRecord(SetFavorite);
+        BinaryCodec::putU32(record, static_cast<uint32_t>(contact.getContactId()));
+        BinaryCodec::putU64(record, static_cast<uint64_t>(contact.getModifiedDate()));
+        record.push_back(contact.getIsFavorite() ? 1 : 0);
+        return commitRecord();
+    }
+
+    // Sequence number of the most recent record written or replayed
+    uint64_t lastSequence() const { return nextSequence - 1; }
+    uint64_t getRecordCount() const { return recordCount; }
+    uint64_t getByteCount() const { return byteCount; }
+    // True when some change since the last snapshot is missing from the
+    // file, so only a full save keeps it
+    bool hasLostRecords() const { return lostRecords; }
+};
+
+inline bool JournalReplay::apply(uint8_t operation, const char* payload, size_t length) {
+    switch (operation) {
+        case MutationJournal::AddContact:
+        case MutationJournal::UpdateContact: {
+            Contact contact = ContactCodec::makeEmpty(0);
+            if (!ContactCodec::decode(payload, length, contact)) return false;
+            if (reserveIds) ContactCodec::reserveId(contact.getContactId());
+            Contact* existing = find(contact.getContactId());
+            if (existing != nullptr) {
+                *existing = std::move(contact);
+            } else {
+                positions[contact.getContactId()] = contacts.size();
+                contacts.push_back(std::move(contact));
+                deleted.push_back(0);
+            }
+            return true;
+        }
+        case MutationJournal::DeleteContact: {
+            if (length < 4) return false;
+            auto it = positions.find(static_cast<int>(BinaryCodec::getU32(payload)));
+            if (it != positions.end() && !deleted[it->second]) {
+                deleted[it->second] = 1;
+                ++deletedCount;
+                positions.erase(it);
+            }
+            return true;
+        }
+        case MutationJournal::AddTag:
+        case MutationJournal::RemoveTag: {
+            if (length < 16) return false;
+            uint32_t tagLength = BinaryCodec::getU32(payload + 12);
+            if (tagLength > length - 16) return false;
+            Contact* contact = find(static_cast<int>(BinaryCodec::getU32(payload)));
+            if (contact != nullptr) {
+                std::string tag(payload + 16, tagLength);
+                if (operation == MutationJournal::AddTag) contact->addTag(tag);
+                else contact->removeTag(tag);
+                ContactCodec::setModifiedDate(*contact, static_cast<std::time_t>(BinaryCodec::getU64(payload + 4)));
+            }
+            return true;
+        }
+        case MutationJournal::SetFavorite: {
+            if (length < 13) return false;
+            Contact* contact = find(static_cast<int>(BinaryCodec::getU32(payload)));
+            if (contact != nullptr) {
+                contact->setIsFavorite(payload[12] != 0);
+                ContactCodec::setModifiedDate(*contact, static_cast<std::time_t>(BinaryCodec::getU64(payload + 4)));
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Folds a rotated journal segment into a new snapshot on a background
+// thread: loads the current snapshot file, replays the segment over it and
+// atomically renames the result into place. The live contact list is never
+// touched, so mutations and searches keep running during compaction.
+// After a failure, triggers from mutations back off exponentially so a
+// segment that cannot be folded is not retried on every change.
+class SnapshotCompactor {
+private:
+    std::thread worker;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> completed;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint32_t> consecutiveFailures;
+    std::atomic<int64_t> retryAtMillis; // steady clock
+    std::atomic<uint64_t> lastDurationMicros;
+    std::atomic<bool> lastSucceeded;
+    std::mutex idleMutex;
+    std::condition_variable idle;
+
+    SnapshotCompactor(const SnapshotCompactor&);
+    SnapshotCompactor& operator=(const SnapshotCompactor&);
+
+    static const int64_t kFirstBackoffMillis = 5000;
+    static const int64_t kMaxBackoffMillis = 10 * 60 * 1000;
+
+    static int64_t steadyMillis() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool compact(const std::string& snapshotPath, const std::string& segmentPath,
+                 const SimpleEncryption& encryptor, bool compress) {
+        std::vector<Contact> contacts;
+        uint64_t sequence = 0;
+        {
+            MappedFile mapped;
+            if (mapped.open(snapshotPath) && mapped.size() > 0) {
+                SnapshotFile::Header header;
+                if (!SnapshotFile::readHeader(mapped.begin(), mapped.size(), header)) {
+                    return false;
+                }
+                contacts.reserve(header.recordCount);
+                if (!SnapshotFile::readParts(mapped.begin(), header, 0, SnapshotFile::partCount(header),
+                                             encryptor, contacts)) {
+                    return false;
+                }
+                sequence = header.journalSequence;
+            }
+        }
+
+        MutationJournal::ReplayResult result =
+            MutationJournal::replayFile(segmentPath, encryptor, sequence, contacts, false);
+        if (!SnapshotFile::write(snapshotPath, contacts, encryptor, result.lastSequence, compress)) {
+            return false;
+        }
+        std::remove(segmentPath.c_str());
+        return true;
+    }
+
+public:
+    SnapshotCompactor()
+        : running(false), completed(0), failed(0), consecutiveFailures(0), retryAtMillis(0),
+          lastDurationMicros(0), lastSucceeded(true) {}
+
+    ~SnapshotCompactor() {
+        wait();
+    }
+
+    bool isRunning() const { return running.load(); }
+
+    void start(const std::string& snapshotPath, const std::string& segmentPath,
+               const SimpleEncryption& encryptor, Logger& logger, bool compress = false) {
+        wait();
+        running = true;
+        worker = std::thread([this, snapshotPath, segmentPath, encryptor, &logger, compress]() {
+            auto begin = std::chrono::steady_clock::now();
+            bool ok = compact(snapshotPath, segmentPath, encryptor, compress);
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - begin);
+            lastDurationMicros = static_cast<uint64_t>(elapsed.count());
+            lastSucceeded = ok;
+            if (ok) {
+                ++completed;
+                consecutiveFailures = 0;
+                retryAtMillis = 0;
+                logger.log("Journal compacted into snapshot in " +
+                           std::to_string(elapsed.count() / 1000) + " ms", "INFO");
+            } else {
+                ++failed;
+                uint32_t failures = ++consecutiveFailures;
+                int64_t backoff = kFirstBackoffMillis << std::min<uint32_t>(failures - 1, 16);
+                backoff = std::min(backoff, kMaxBackoffMillis);
+                retryAtMillis = steadyMillis() + backoff;
+                logger.log("Journal compaction failed (" + std::to_string(failures) +
+                           " in a row), segment kept, next retry in " +
+                           std::to_string(backoff / 1000) + " s: " + segmentPath, "ERROR");
+            }
+            std::lock_guard<std::mutex> lock(idleMutex);
+            running = false;
+            idle.notify_all();
+        });
+    }
+
+    // Like wait(), but safe to call from threads other than the one that
+    // starts compactions
+    void waitUntilIdle() {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        idle.wait(lock, [this]() { return !running.load(); });
+    }
+
+    // Blocks until a running compaction has finished
+    void wait() {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // Time left before a failed compaction may be retried automatically
+    int64_t getRetryDelayMillis() const {
+        int64_t remaining = retryAtMillis.load() - steadyMillis();
+        return remaining > 0 ? remaining : 0;
+    }
+
+    bool isBackingOff() const { return getRetryDelayMillis() > 0; }
+
+    uint64_t getCompletedCount() const { return completed.load(); }
+    uint64_t getFailedCount() const { return failed.load(); }
+    uint32_t getConsecutiveFailures() const { return consecutiveFailures.load(); }
+    uint64_t getLastDurationMicros() const { return lastDurationMicros.load(); }
+    bool getLastSucceeded() const { return lastSucceeded.load(); }
+};
+
+const int64_t SnapshotCompactor::kFirstBackoffMillis;
+const int64_t SnapshotCompactor::kMaxBackoffMillis;
+
+struct BackupStatus {
+    std::time_t lastCompleted;
+    uint64_t lastDurationMillis;
+    uint64_t lastTotalBytes;
+    uint64_t lastNewBytes;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t rejected;   // refused because the queue was full
+    uint64_t coalesced;  // merged into a request that was already waiting
+    size_t pending;
+    bool running;
+};
+
+// Runs backups on a dedicated thread so mutations only pay for queueing a
+// request. The queue is bounded: a request that finds another one still
+// waiting is merged into it, and one that finds the queue full is refused
+// so the caller can retry later.
+class BackupWorker {
+public:
+    typedef std::function<void()> PrepareFn;
+
+private:
+    struct Request {
+        uint64_t ticket;
+        std::string sourceFile;
+        PrepareFn prepare;
+    };
+
+    BackupManager& backupManager;
+    Logger& logger;
+    size_t capacity;
+    std::deque<Request> queue;
+    std::thread worker;
+    mutable std::mutex queueMutex;
+    std::condition_variable changed;
+    bool stopping;
+    uint64_t nextTicket;
+    uint64_t finishedTicket;
+    bool lastSucceeded;
+    BackupStatus status;
+
+    BackupWorker(const BackupWorker&);
+    BackupWorker& operator=(const BackupWorker&);
+
+    void run() {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        while (true) {
+            changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+
+            Request request = queue.front();
+            queue.pop_front();
+            status.pending = queue.size();
+            status.running = true;
+            lock.unlock();
+
+            auto begin = std::chrono::steady_clock::now();
+            if (request.prepare) request.prepare();
+            bool ok = backupManager.createBackup(request.sourceFile);
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - begin).count();
+            if (ok) {
+                logger.log("Backup created in " + std::to_string(elapsed) + " ms (" +
+                           std::to_string(backupManager.getLastNewBytes()) + " new bytes)", "INFO");
+            } else {
+                logger.log("Backup of " + request.sourceFile + " failed", "ERROR");
+            }
+
+            lock.lock();
+            status.running = false;
+            if (ok) {
+                ++status.completed;
+                status.lastCompleted = std::time(nullptr);
+                status.lastDurationMillis = static_cast<uint64_t>(elapsed);
+                status.lastTotalBytes = backupManager.getLastTotalBytes();
+                status.lastNewBytes = backupManager.getLastNewBytes();
+            } else {
+                ++status.failed;
+            }
+            finishedTicket = request.ticket;
+            lastSucceeded = ok;
+            changed.notify_all();
+        }
+    }
+
+public:
+    BackupWorker(BackupManager& manager, Logger& logger, size_t capacity = 2)
+        : backupManager(manager), logger(logger), capacity(capacity), stopping(false),
+          nextTicket(1), finishedTicket(0), lastSucceeded(false), status() {
+        worker = std::thread(&BackupWorker::run, this);
+    }
+
+    ~BackupWorker() {
+        stop();
+    }
+
+    // Returns a ticket for wait(), or 0 if the queue is full
+    uint64_t enqueue(const std::string& sourceFile, const PrepareFn& prepare) {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (!queue.empty() && queue.back().sourceFile == sourceFile) {
+            ++status.coalesced;
+            return queue.back().ticket;
+        }
+        if (queue.size() >= capacity) {
+            ++status.rejected;
+            return 0;
+        }
+        Request request = { nextTicket++, sourceFile, prepare };
+        queue.push_back(request);
+        status.pending = queue.size();
+        changed.notify_all();
+        return request.ticket;
+    }
+
+    // Blocks until the request with the given ticket has run
+    bool wait(uint64_t ticket) {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        changed.wait(lock, [this, ticket]() { return finishedTicket >= ticket; });
+        return finishedTicket == ticket && lastSucceeded;
+    }
+
+    BackupStatus getStatus() const {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        return status;
+    }
+
+    // Finishes queued backups and stops the thread
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+};
+
+// Substring search over packed bytes. Candidate positions are found by
+// comparing the needle's first and last bytes against 16 or 32 haystack
+// positions at a time, and only those are checked with memcmp. The AVX2
+// kernel is picked at runtime when the CPU has it; otherwise SSE2, or plain
+// memchr on other targets. Matching is byte-exact, so callers fold both
+// sides for a case-insensitive search.
+class SubstringScanner {
+private:
+    typedef size_t (*Kernel)(const char*, size_t, const char*, size_t);
+
+    static bool verify(const char* at, const char* needle, size_t needleLength) {
+        return needleLength <= 2 || std::memcmp(at + 1, needle + 1, needleLength - 2) == 0;
+    }
+
+    static size_t findScalar(const char* data, size_t length, const char* needle, size_t needleLength) {
+        const char* end = data + length - needleLength + 1;
+        const char* at = data;
+        while (at < end) {
+            at = static_cast<const char*>(std::memchr(at, needle[0], end - at));
+            if (!at) break;
+            if (at[needleLength - 1] == needle[needleLength - 1] && verify(at, needle, needleLength)) {
+                return at - data;
+            }
+            ++at;
+        }
+        return std::string::npos;
+    }
+
+#if defined(__SSE2__) || defined(_M_X64)
+    static size_t findSse2(const char* data, size_t length, const char* needle, size_t needleLength) {
+        const __m128i first = _mm_set1_epi8(needle[0]);
+        const __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+        size_t i = 0;
+        for (; i + needleLength - 1 + 16 <= length; i += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + needleLength - 1));
+            unsigned mask = static_cast<unsigned>(
+                _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last))));
+            while (mask) {
+                size_t at = i + countTrailingZeros(mask);
+                if (verify(data + at, needle, needleLength)) return at;
+                mask &= mask - 1;
+            }
+        }
+        size_t rest = findScalar(data + i, length - i, needle, needleLength);
+        return rest == std::string::npos ? rest : i + rest;
+    }
+#endif
+
+#ifdef CMS_HAVE_AVX2_KERNEL
+    static __attribute__((target("avx2")))
+    size_t findAvx2(const char* data, size_t length, const char* needle, size_t needleLength) {
+        const __m256i first = _mm256_set1_epi8(needle[0]);
+        const __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+        size_t i = 0;
+        for (; i + needleLength - 1 + 32 <= length; i += 32) {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + needleLength - 1));
+            unsigned mask = static_cast<unsigned>(
+                _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last))));
+            while (mask) {
+                size_t at = i + countTrailingZeros(mask);
+                if (verify(data + at, needle, needleLength)) return at;
+                mask &= mask - 1;
+            }
+        }
+        size_t rest = findScalar(data + i, length - i, needle, needleLength);
+        return rest == std::string::npos ? rest : i + rest;
+    }
+#endif
+
+    static unsigned countTrailingZeros(unsigned mask) {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(__builtin_ctz(mask));
+#else
+        unsigned n = 0;
+        while (!(mask & 1u)) {
+            mask >>= 1;
+            ++n;
+        }
+        return n;
+#endif
+    }
+
+    static Kernel selectKernel() {
+#ifdef CMS_HAVE_AVX2_KERNEL
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return &findAvx2;
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        return &findSse2;
+#else
+        return &findScalar;
+#endif
+    }
+
+    static Kernel kernel() {
+        static const Kernel selected = selectKernel();
+        return selected;
+    }
+
+public:
+    // Offset of the first occurrence of the needle, or npos
+    static size_t find(const char* data, size_t length, const std::string& needle) {
+        if (needle.empty()) return 0;
+        if (needle.size() > length) return std::string::npos;
+        return kernel()(data, length, needle.data(), needle.size());
+    }
+
+    static const char* kernelName() {
+        Kernel k = kernel();
+#ifdef CMS_HAVE_AVX2_KERNEL
+        if (k == &findAvx2) return "AVX2";
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        if (k == &findSse2) return "SSE2";
+#endif
+        return k == &findScalar ? "scalar" : "unknown";
+    }
+};
+
+// One text column for every contact in list order, packed into a single
+// buffer so a scan streams through memory instead of chasing a string per
+// contact. Fields inside a row are separated by NUL bytes, which never occur
+// in a query.
+class PackedColumn {
+private:
+    std::string bytes;
+    std::vector<size_t> rowEnds;
+
+public:
+    void clear() {
+        bytes.clear();
+        rowEnds.clear();
+    }
+
+    // Row text is appended to the returned buffer, then closed with endRow
+    std::string& buffer() { return bytes; }
+
+    void endRow() {
+        bytes.push_back('\0');
+        rowEnds.push_back(bytes.size());
+    }
+
+    // Rows containing the needle, in row order
+    void findRows(const std::string& needle, std::vector<size_t>& rows) const {
+        rows.clear();
+        if (needle.empty()) {
+            for (size_t row = 0; row < rowEnds.size(); ++row) rows.push_back(row);
+            return;
+        }
+        size_t from = 0;
+        while (from < bytes.size()) {
+            size_t hit = SubstringScanner::find(bytes.data() + from, bytes.size() - from, needle);
+            if (hit == std::string::npos) break;
+            size_t row = std::upper_bound(rowEnds.begin(), rowEnds.end(), from + hit) - rowEnds.begin();
+            rows.push_back(row);
+            // One hit per row; resume at the next row
+            from = rowEnds[row];
+        }
+    }
+
+    size_t getRowCount() const { return rowEnds.size(); }
+    size_t getByteCount() const { return bytes.size(); }
+};
+
+// Compressed radix tree over digit-only phone numbers, mapping each number
+// to the ids of the contacts that have it. Edges carry digit runs and a
+// node keeps one child slot per digit. Removing a number merges any node
+// left with no ids and a single child back into it, so every node either
+// ends a number or branches, and a prefix query costs the query length
+// plus the size of the matching subtree. A tree built from reversed digits
+// answers suffix queries the same way.
+class PhoneRadixTree {
+private:
+    struct Node {
+        std::string label;
+        int32_t children[10];
+        std::vector<int> ids;
+        
+        Node() { std::fill(children, children + 10, -1); }
+    };
+    std::vector<Node> nodes; // nodes[0] is the root, with an empty label
+    std::vector<int32_t> freeNodes;
+    bool reversed;
+    
+    std::string keyOf(const std::string& phone) const {
+        std::string key = digitsOf(phone);
+        if (reversed) std::reverse(key.begin(), key.end());
+        return key;
+    }
+    
+    int32_t allocate() {
+        if (!freeNodes.empty()) {
+            int32_t index = freeNodes.back();
+            freeNodes.pop_back();
+            nodes[index] = Node();
+            return index;
+        }
+        nodes.push_back(Node());
+        return static_cast<int32_t>(nodes.size() - 1);
+    }
+    
+    void release(int32_t index) {
+        nodes[index].label.clear();
+        nodes[index].ids.clear();
+        freeNodes.push_back(index);
+    }
+    
+    int32_t onlyChild(int32_t index) const {
+        int32_t child = -1;
+        for (int32_t c : nodes[index].children) {
+            if (c < 0) continue;
+            if (child >= 0) return -1;
+            child = c;
+        }
+        return child;
+    }
+    
+    // Folds a non-root node that neither ends a number nor branches into
+    // its single child
+    void mergeWithChild(int32_t index) {
+        if (index == 0 || !nodes[index].ids.empty()) return;
+        int32_t child = onlyChild(index);
+        if (child < 0) return;
+        nodes[index].label += nodes[child].label;
+        std::copy(nodes[child].children, nodes[child].children + 10, nodes[index].children);
+        nodes[index].ids.swap(nodes[child].ids);
+        release(child);
+    }
+    
+    void collect(int32_t index, std::vector<int>& out) const {
+        std::vector<int32_t> stack(1, index);
+        while (!stack.empty()) {
+            const Node& node = nodes[stack.back()];
+            stack.pop_back();
+            out.insert(out.end(), node.ids.begin(), node.ids.end());
+            for (int32_t child : node.children) {
+                if (child >= 0) stack.push_back(child);
+            }
+        }
+    }
+
+public:
+    explicit PhoneRadixTree(bool reversedDigits = false) : nodes(1), reversed(reversedDigits) {}
+    
+    static void appendDigits(const std::string& phone, std::string& out) {
+        for (char c : phone) {
+            if (c >= '0' && c <= '9') out.push_back(c);
+        }
+    }
+    
+    static std::string digitsOf(const std::string& phone) {
+        std::string digits;
+        appendDigits(phone, digits);
+        return digits;
+    }
+    
+    void clear() {
+        nodes.assign(1, Node());
+        freeNodes.clear();
+    }
+    
+    void add(int contactId, const std::string& phone) {
+        std::string key = keyOf(phone);
+        int32_t node = 0;
+        size_t pos = 0;
+        while (pos < key.size()) {
+            int digit = key[pos] - '0';
+            int32_t child = nodes[node].children[digit];
+            if (child < 0) {
+                child = allocate();
+                nodes[child].label = key.substr(pos);
+                nodes[node].children[digit] = child;
+                node = child;
+                pos = key.size();
+                break;
+            }
+            const std::string& label = nodes[child].label;
+            size_t common = 0;
+            while (common < label.size() && pos + common < key.size() && label[common] == key[pos + common]) {
+                ++common;
+            }
+            if (common < label.size()) {
+                // Split the edge where the key leaves it
+                int32_t middle = allocate();
+                nodes[middle].label = nodes[child].label.substr(0, common);
+                nodes[middle].children[nodes[child].label[common] - '0'] = child;
+                nodes[child].label.erase(0, common);
+                nodes[node].children[digit] = middle;
+                child = middle;
+            }
+            node = child;
+            pos += common;
+        }
+        std::vector<int>& ids = nodes[node].ids;
+        if (std::find(ids.begin(), ids.end(), contactId) == ids.end()) ids.push_back(contactId);
+    }
+    
+    void remove(int contactId, const std::string& phone) {
+        std::string key = keyOf(phone);
+        // Path of (parent, digit) edges taken, to prune on the way back
+        std::vector<std::pair<int32_t, int>> path;
+        int32_t node = 0;
+        size_t pos = 0;
+        while (pos < key.size()) {
+            int digit = key[pos] - '0';
+            int32_t child = nodes[node].children[digit];
+            if (child < 0) return;
+            const std::string& label = nodes[child].label;
+            if (key.compare(pos, label.size(), label) != 0) return;
+            path.push_back(std::make_pair(node, digit));
+            node = child;
+            pos += label.size();
+        }
+        std::vector<int>& ids = nodes[node].ids;
+        auto it = std::find(ids.begin(), ids.end(), contactId);
+        if (it == ids.end()) return;
+        ids.erase(it);
+        
+        if (node != 0 && ids.empty() && onlyChild(node) < 0) {
+            bool leaf = std::all_of(nodes[node].children, nodes[node].children + 10,
+                                    [](int32_t c) { return c < 0; });
+            if (leaf) {
+                nodes[path.back().first].children[path.back().second] = -1;
+                release(node);
+                mergeWithChild(path.back().first);
+                return;
+            }
+        }
+        mergeWithChild(node);
+    }
+    
+    // Ids of contacts whose number starts with the given digits (ends with
+    // them, for a reversed tree). Other characters in the query are ignored.
+    void find(const std::string& query, std::vector<int>& out) const {
+        out.clear();
+        std::string key = keyOf(query);
+        int32_t node = 0;
+        size_t pos = 0;
+        while (pos < key.size()) {
+            int32_t child = nodes[node].children[key[pos] - '0'];
+            if (child < 0) return;
+            const std::string& label = nodes[child].label;
+            size_t length = std::min(label.size(), key.size() - pos);
+            if (key.compare(pos, length, label, 0, length) != 0) return;
+            node = child;
+            pos += length;
+        }
+        collect(node, out);
+    }
+    
+    size_t getNodeCount() const { return nodes.size() - freeNodes.size(); }
+};
+
+// Refers to a contact in a ContactSlotMap. A slot's generation changes when
+// its contact is erased, so a handle kept past the erase stops resolving
+// instead of reaching whichever contact reuses the slot. Generation 0 is
+// never issued; it marks the null handle.
+struct ContactHandle {
+    uint32_t index;
+    uint32_t generation;
+    
+    ContactHandle() : index(0), generation(0) {}
+    ContactHandle(uint32_t slotIndex, uint32_t slotGeneration) : index(slotIndex), generation(slotGeneration) {}
+    
+    bool isNull() const { return generation == 0; }
+    bool operator==(const ContactHandle& other) const {
+        return index == other.index && generation == other.generation;
+    }
+    bool operator!=(const ContactHandle& other) const { return !(*this == other); }
+};
+
+// Contact storage for the manager. Each contact sits in a slot that keeps
+// its place until the contact is erased: slots live in a deque, so adding
+// never moves existing contacts, and a freed slot is reused by a later add.
+// The display order is a separate list of handles, which is all that
+// sorting rearranges. Iteration and operator[] follow the display order.
+//
+// Erasing leaves a tombstone in the display order, so a delete costs O(1)
+// however long the list is. The first positional read afterwards (operator[],
+// iteration, sort) squeezes all tombstones out in one pass, so a batch of
+// deletes pays for a single compaction. Because reads may compact, they
+// must not run concurrently with each other while tombstones are pending.
+class ContactSlotMap {
+private:
+    struct Slot {
+        Contact contact;
+        uint32_t generation;
+        bool live;
+    };
+    std::deque<Slot> slots;
+    std::vector<uint32_t> freeSlots;
+    mutable std::vector<ContactHandle> order; // null handles are tombstones
+    mutable std::vector<uint32_t> positions;  // per slot, index in order while live
+    mutable size_t tombstones;
+    
+    void compact() const {
+        if (tombstones == 0) return;
+        size_t kept = 0;
+        for (ContactHandle handle : order) {
+            if (handle.isNull()) continue;
+            positions[handle.index] = static_cast<uint32_t>(kept);
+            order[kept++] = handle;
+        }
+        order.resize(kept);
+        tombstones = 0;
+    }
+
+public:
+    template <typename Owner, typename Value>
+    class OrderIterator {
+    private:
+        Owner* owner;
+        size_t position;
+        
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Contact value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Value* pointer;
+        typedef Value& reference;
+        
+        OrderIterator(Owner* map, size_t at) : owner(map), position(at) {}
+        reference operator*() const { return owner->slots[owner->order[position].index].contact; }
+        pointer operator->() const { return &**this; }
+        OrderIterator& operator++() {
+            ++position;
+            return *this;
+        }
+        OrderIterator operator++(int) {
+            OrderIterator before = *this;
+            ++position;
+            return before;
+        }
+        bool operator==(const OrderIterator& other) const { return position == other.position; }
+        bool operator!=(const OrderIterator& other) const { return position != other.position; }
+    };
+    typedef OrderIterator<ContactSlotMap, Contact> iterator;
+    typedef OrderIterator<const ContactSlotMap, const Contact> const_iterator;
+    
+    ContactSlotMap() : tombstones(0) {}
+    
+    iterator begin() {
+        compact();
+        return iterator(this, 0);
+    }
+    iterator end() {
+        compact();
+        return iterator(this, order.size());
+    }
+    const_iterator begin() const {
+        compact();
+        return const_iterator(this, 0);
+    }
+    const_iterator end() const {
+        compact();
+        return const_iterator(this, order.size());
+    }
+    
+    size_t size() const { return order.size() - tombstones; }
+    bool empty() const { return size() == 0; }
+    
+    Contact& operator[](size_t position) {
+        compact();
+        return slots[order[position].index].contact;
+    }
+    const Contact& operator[](size_t position) const {
+        compact();
+        return slots[order[position].index].contact;
+    }
+    ContactHandle handleAt(size_t position) const {
+        compact();
+        return order[position];
+    }
+    
+    // Null for a null or stale handle
+    Contact* get(ContactHandle handle) {
+        return const_cast<Contact*>(static_cast<const ContactSlotMap*>(this)->get(handle));
+    }
+    
+    const Contact* get(ContactHandle handle) const {
+        if (handle.index >= slots.size()) return nullptr;
+        const Slot& slot = slots[handle.index];
+        return slot.live && slot.generation == handle.generation ? &slot.contact : nullptr;
+    }
+    
+    // Handle of the contact in a slot, null if the slot is free. Slot
+    // indexes are dense, so they serve as ordinals for bitmap indexes.
+    ContactHandle handleOfSlot(uint32_t index) const {
+        if (index >= slots.size() || !slots[index].live) return ContactHandle();
+        return ContactHandle(index, slots[index].generation);
+    }
+    
+    // Appends the contact to the display order
+    ContactHandle insert(Contact contact) {
+        uint32_t index;
+        if (!freeSlots.empty()) {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+            slots[index].contact = std::move(contact);
+        } else {
+            index = static_cast<uint32_t>(slots.size());
+            slots.push_back(Slot{std::move(contact), 1, false});
+            positions.push_back(0);
+        }
+        Slot& slot = slots[index];
+        slot.live = true;
+        positions[index] = static_cast<uint32_t>(order.size());
+        order.push_back(ContactHandle(index, slot.generation));
+        return order.back();
+    }
+    
+    bool erase(ContactHandle handle) {
+        if (!get(handle)) return false;
+        Slot& slot = slots[handle.index];
+        slot.live = false;
+        slot.contact = ContactCodec::makeEmpty(0);
+        if (++slot.generation == 0) slot.generation = 1;
+        freeSlots.push_back(handle.index);
+        order[positions[handle.index]] = ContactHandle();
+        ++tombstones;
+        return true;
+    }
+    
+    // Replaces the contents with the given contacts, in that order, so
+    // position i holds loaded[i]
+    void assign(std::vector<Contact>&& loaded) {
+        slots.clear();
+        freeSlots.clear();
+        order.clear();
+        positions.clear();
+        tombstones = 0;
+        order.reserve(loaded.size());
+        positions.reserve(loaded.size());
+        for (auto& contact : loaded) insert(std::move(contact));
+        loaded.clear();
+    }
+    
+    template <typename Compare>
+    void sort(Compare less) {
+        compact();
+        std::sort(order.begin(), order.end(), [this, &less](ContactHandle a, ContactHandle b) {
+            return less(slots[a.index].contact, slots[b.index].contact);
+        });
+        for (size_t i = 0; i < order.size(); ++i) {
+            positions[order[i].index] = static_cast<uint32_t>(i);
+        }
+    }
+    
+    // Puts live handles into display order
+    void sortByPosition(std::vector<ContactHandle>& handles) const {
+        std::sort(handles.begin(), handles.end(), [this](ContactHandle a, ContactHandle b) {
+            return positions[a.index] < positions[b.index];
+        });
+    }
+};
+
+// The outcome of a search: handles of the matching contacts in result
+// order rather than copies, 8 bytes per match. It is read a page at a time
+// and each page carries a continuation token for the next. The token names
+// a position and the handle found there, so it resumes only the result set
+// that issued it. Contacts deleted after the search are skipped as pages
+// are read.
+class ContactResultSet {
+private:
+    std::vector<ContactHandle> handles;
+    
+    static std::string makeToken(size_t position, ContactHandle handle) {
+        return std::to_string(position) + "." + std::to_string(handle.index) + "." +
+               std::to_string(handle.generation);
+    }
+    
+    bool parseToken(const std::string& token, size_t& position) const {
+        std::istringstream in(token);
+        unsigned long long offset = 0;
+        uint32_t index = 0, generation = 0;
+        char dot1 = 0, dot2 = 0, rest = 0;
+        if (!(in >> offset >> dot1 >> index >> dot2 >> generation) || dot1 != '.' || dot2 != '.' || (in >> rest)) {
+            return false;
+        }
+        if (offset >= handles.size() || handles[offset] != ContactHandle(index, generation)) return false;
+        position = static_cast<size_t>(offset);
+        return true;
+    }
+
+public:
+    struct Page {
+        std::vector<const Contact*> contacts; // valid until the contact list next changes
+        size_t offset;                       // result position the page was read from
+        std::string nextToken;               // empty on the last page
+    };
+    
+    ContactResultSet() {}
+    explicit ContactResultSet(std::vector<ContactHandle>&& matches) : handles(std::move(matches)) {}
+    
+    size_t size() const { return handles.size(); }
+    bool empty() const { return handles.empty(); }
+    const std::vector<ContactHandle>& getHandles() const { return handles; }
+    
+    // Keeps the first count results
+    void truncate(size_t count) {
+        if (count < handles.size()) handles.resize(count);
+    }
+    
+    // Up to pageSize live contacts, from the start for an empty token or
+    // from where the token's page left off. False for a token this result
+    // set did not issue.
+    bool read(const ContactSlotMap& contacts, size_t pageSize, const std::string& token, Page& page) const {
+        size_t position = 0;
+        if (!token.empty() && !parseToken(token, position)) return false;
+        if (pageSize == 0) pageSize = 1;
+        page.contacts.clear();
+        page.offset = position;
+        page.nextToken.clear();
+        for (; position < handles.size() && page.contacts.size() < pageSize; ++position) {
+            const Contact* contact = contacts.get(handles[position]);
+            if (contact) page.contacts.push_back(contact);
+        }
+        while (position < handles.size() && !contacts.get(handles[position])) ++position;
+        if (position < handles.size()) page.nextToken = makeToken(position, handles[position]);
+        return true;
+    }
+};
+
+// Flat open-addressing hash from 64-bit keys to contact handles. Key and
+// handle sit side by side in one array probed linearly, so a lookup usually
+// touches a single cache line. Erase shifts the rest of the probe run back
+// rather than leaving tombstones, so probes stay short as contacts come
+// and go.
+class ContactHashIndex {
+private:
+    struct Slot {
+        uint64_t key;
+        ContactHandle handle; // null marks an empty slot
+    };
+    std::vector<Slot> slots;
+    size_t count;
+    
+    static uint64_t mix(uint64_t key) {
+        key ^= key >> 30;
+        key *= 0xbf58476d1ce4e5b9ULL;
+        key ^= key >> 27;
+        key *= 0x94d049bb133111ebULL;
+        return key ^ (key >> 31);
+    }
+    
+    size_t slotOf(uint64_t key) const {
+        size_t mask = slots.size() - 1;
+        size_t i = mix(key) & mask;
+        while (!slots[i].handle.isNull() && slots[i].key != key) i = (i + 1) & mask;
+        return i;
+    }
+    
+    void rehash(size_t capacity) {
+        std::vector<Slot> old;
+        old.swap(slots);
+        slots.assign(capacity, Slot());
+        for (const Slot& slot : old) {
+            if (!slot.handle.isNull()) slots[slotOf(slot.key)] = slot;
+        }
+    }
+
+public:
+    ContactHashIndex() : slots(16, Slot()), count(0) {}
+    
+    void clear() {
+        slots.assign(16, Slot());
+        count = 0;
+    }
+    
+    // Sizes the table so `expected` keys fit without growing
+    void reserve(size_t expected) {
+        size_t capacity = 16;
+        while (capacity * 3 / 4 < expected) capacity *= 2;
+        if (capacity > slots.size()) rehash(capacity);
+    }
+    
+    // The null handle if the key is absent
+    ContactHandle find(uint64_t key) const {
+        return slots[slotOf(key)].handle;
+    }
+    
+    // Inserts the key or repoints it
+    void set(uint64_t key, ContactHandle handle) {
+        size_t i = slotOf(key);
+        if (slots[i].handle.isNull()) {
+            if ((count + 1) * 4 > slots.size() * 3) {
+                rehash(slots.size() * 2);
+                i = slotOf(key);
+            }
+            ++count;
+        }
+        slots[i].key = key;
+        slots[i].handle = handle;
+    }
+    
+    void erase(uint64_t key) {
+        size_t mask = slots.size() - 1;
+        size_t hole = slotOf(key);
+        if (slots[hole].handle.isNull()) return;
+        slots[hole].handle = ContactHandle();
+        --count;
+        // Move back any later entry of the run whose home slot is at or
+        // before the hole, so no probe stops early at the gap
+        for (size_t i = (hole + 1) & mask; !slots[i].handle.isNull(); i = (i + 1) & mask) {
+            size_t home = mix(slots[i].key) & mask;
+            if (((i - home) & mask) >= ((i - hole) & mask)) {
+                slots[hole] = slots[i];
+                slots[i].handle = ContactHandle();
+                hole = i;
+            }
+        }
+    }
+    
+    size_t size() const { return count; }
+    size_t getMemoryBytes() const { return slots.capacity() * sizeof(Slot); }
+};
+
+// Set of 32-bit ordinals in the roaring layout. Values are grouped by their
+// high 16 bits into containers, each holding the low halves as a sorted
+// array while there are at most 4096 of them and as a 65536-bit bitmap
+// beyond that, so sparse and dense sets both stay small. Set operations
+// pair up containers by key and work a 64-bit word at a time where both
+// sides are bitmaps.
+class RoaringBitmap {
+private:
+    static const size_t kArrayMax = 4096;
+    static const size_t kWords = 1024;
+
+    struct Container {
+        uint16_t key;
+        uint32_t cardinality;
+        std::vector<uint16_t> array;
+        std::vector<uint64_t> bits; // kWords words once this is a bitmap
+
+        explicit Container(uint16_t high = 0) : key(high), cardinality(0) {}
+        bool isBitmap() const { return !bits.empty(); }
+        bool test(uint16_t low) const {
+            if (isBitmap()) return (bits[low >> 6] >> (low & 63)) & 1;
+            return std::binary_search(array.begin(), array.end(), low);
+        }
+    };
+    std::vector<Container> containers; // sorted by key
+
+    static unsigned countTrailingZeros(uint64_t word) {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(__builtin_ctzll(word));
+#else
+        unsigned n = 0;
+        while (!(word & 1)) {
+            word >>= 1;
+            ++n;
+        }
+        return n;
+#endif
+    }
+
+    static unsigned countBits(uint64_t word) {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(__builtin_popcountll(word));
+#else
+        unsigned n = 0;
+        for (; word; word &= word - 1) ++n;
+        return n;
+#endif
+    }
+
+    static void toBitmap(Container& container) {
+        container.bits.assign(kWords, 0);
+        for (uint16_t low : container.array) container.bits[low >> 6] |= 1ULL << (low & 63);
+        std::vector<uint16_t>().swap(container.array);
+    }
+
+    static void toArray(Container& container) {
+        std::vector<uint16_t> array;
+        array.reserve(container.cardinality);
+        for (size_t w = 0; w < kWords; ++w) {
+            for (uint64_t word = container.bits[w]; word; word &= word - 1) {
+                array.push_back(static_cast<uint16_t>(w * 64 + countTrailingZeros(word)));
+            }
+        }
+        container.array.swap(array);
+        std::vector<uint64_t>().swap(container.bits);
+    }
+
+    // Recounts a container built by a set operation and gives it the form
+    // its size calls for
+    static void settle(Container& container) {
+        if (container.isBitmap()) {
+            uint32_t count = 0;
+            for (uint64_t word : container.bits) count += countBits(word);
+            container.cardinality = count;
+            if (count <= kArrayMax) toArray(container);
+        } else {
+            container.cardinality = static_cast<uint32_t>(container.array.size());
+            if (container.cardinality > kArrayMax) toBitmap(container);
+        }
+    }
+
+    static Container asBitmap(const Container& container) {
+        Container copy = container;
+        if (!copy.isBitmap()) toBitmap(copy);
+        return copy;
+    }
+
+    std::vector<Container>::iterator locate(uint16_t key) {
+        return std::lower_bound(containers.begin(), containers.end(), key,
+                                [](const Container& c, uint16_t k) { return c.key < k; });
+    }
+
+    std::vector<Container>::const_iterator locate(uint16_t key) const {
+        return std::lower_bound(containers.begin(), containers.end(), key,
+                                [](const Container& c, uint16_t k) { return c.key < k; });
+    }
+
+    enum Operation { And, Or, AndNot };
+
+    static Container combine(const Container& a, const Container& b, Operation operation) {
+        Container out(a.key);
+        if (a.isBitmap() && b.isBitmap()) {
+            out.bits.resize(kWords);
+            for (size_t w = 0; w < kWords; ++w) {
+                out.bits[w] = operation == And ? a.bits[w] & b.bits[w]
+                            : operation == Or ? a.bits[w] | b.bits[w]
+                            : a.bits[w] & ~b.bits[w];
+            }
+        } else if (operation == Or) {
+            if (!a.isBitmap() && !b.isBitmap() && a.array.size() + b.array.size() <= kArrayMax) {
+                std::set_union(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(),
+                               std::back_inserter(out.array));
+            } else {
+                out = asBitmap(a.isBitmap() ? a : b);
+                const Container& other = a.isBitmap() ? b : a;
+                if (other.isBitmap()) {
+                    for (size_t w = 0; w < kWords; ++w) out.bits[w] |= other.bits[w];
+                } else {
+                    for (uint16_t low : other.array) out.bits[low >> 6] |= 1ULL << (low & 63);
+                }
+            }
+        } else if (operation == AndNot && a.isBitmap()) {
+            out = a;
+            for (uint16_t low : b.array) out.bits[low >> 6] &= ~(1ULL << (low & 63));
+        } else if (!a.isBitmap() && !b.isBitmap()) {
+            if (operation == And) {
+                std::set_intersection(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(),
+                                      std::back_inserter(out.array));
+            } else {
+                std::set_difference(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(),
+                                    std::back_inserter(out.array));
+            }
+        } else {
+            // An array against a bitmap keeps the array's values that pass
+            // a bit test
+            const Container& array = a.isBitmap() ? b : a;
+            const Container& bitmap = a.isBitmap() ? a : b;
+            bool keepIfSet = operation == And;
+            for (uint16_t low : array.array) {
+                if (bitmap.test(low) == keepIfSet) out.array.push_back(low);
+            }
+        }
+        settle(out);
+        return out;
+    }
+
+    static RoaringBitmap merge(const RoaringBitmap& a, const RoaringBitmap& b, Operation operation) {
+        RoaringBitmap out;
+        auto left = a.containers.begin();
+        auto right = b.containers.begin();
+        while (left != a.containers.end() || right != b.containers.end()) {
+            if (right == b.containers.end() || (left != a.containers.end() && left->key < right->key)) {
+                if (operation != And) out.containers.push_back(*left);
+                ++left;
+            } else if (left == a.containers.end() || right->key < left->key) {
+                if (operation == Or) out.containers.push_back(*right);
+                ++right;
+            } else {
+                Container combined = combine(*left, *right, operation);
+                if (combined.cardinality > 0) out.containers.push_back(std::move(combined));
+                ++left;
+                ++right;
+            }
+        }
+        return out;
+    }
+
+public:
+    bool add(uint32_t value) {
+        uint16_t key = static_cast<uint16_t>(value >> 16);
+        uint16_t low = static_cast<uint16_t>(value);
+        auto it = locate(key);
+        if (it == containers.end() || it->key != key) it = containers.insert(it, Container(key));
+        Container& container = *it;
+        if (container.isBitmap()) {
+            uint64_t bit = 1ULL << (low & 63);
+            if (container.bits[low >> 6] & bit) return false;
+            container.bits[low >> 6] |= bit;
+        } else if (container.array.empty() || container.array.back() < low) {
+            container.array.push_back(low);
+        } else {
+            auto at = std::lower_bound(container.array.begin(), container.array.end(), low);
+            if (*at == low) return false;
+            container.array.insert(at, low);
+        }
+        if (++container.cardinality > kArrayMax && !container.isBitmap()) toBitmap(container);
+        return true;
+    }
+
+    bool remove(uint32_t value) {
+        uint16_t key = static_cast<uint16_t>(value >> 16);
+        uint16_t low = static_cast<uint16_t>(value);
+        auto it = locate(key);
+        if (it == containers.end() || it->key != key) return false;
+        Container& container = *it;
+        if (container.isBitmap()) {
+            uint64_t bit = 1ULL << (low & 63);
+            if (!(container.bits[low >> 6] & bit)) return false;
+            container.bits[low >> 6] &= ~bit;
+            if (--container.cardinality <= kArrayMax) toArray(container);
+        } else {
+            auto at = std::lower_bound(container.array.begin(), container.array.end(), low);
+            if (at == container.array.end() || *at != low) return false;
+            container.array.erase(at);
+            --container.cardinality;
+        }
+        if (container.cardinality == 0) containers.erase(it);
+        return true;
+    }
+
+    bool contains(uint32_t value) const {
+        uint16_t key = static_cast<uint16_t>(value >> 16);
+        auto it = locate(key);
+        return it != containers.end() && it->key == key && it->test(static_cast<uint16_t>(value));
+    }
+
+    size_t cardinality() const {
+        size_t count = 0;
+        for (const Container& container : containers) count += container.cardinality;
+        return count;
+    }
+
+    bool empty() const { return containers.empty(); }
+
+    void clear() {
+        containers.clear();
+    }
+
+    static RoaringBitmap intersect(const RoaringBitmap& a, const RoaringBitmap& b) { return merge(a, b, And); }
+    static RoaringBitmap unite(const RoaringBitmap& a, const RoaringBitmap& b) { return merge(a, b, Or); }
+    static RoaringBitmap subtract(const RoaringBitmap& a, const RoaringBitmap& b) { return merge(a, b, AndNot); }
+
+    // Calls visit(value) for each value in increasing order
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (const Container& container : containers) {
+            uint32_t high = static_cast<uint32_t>(container.key) << 16;
+            if (!container.isBitmap()) {
+                for (uint16_t low : container.array) visit(high | low);
+                continue;
+            }
+            for (size_t w = 0; w < kWords; ++w) {
+                for (uint64_t word = container.bits[w]; word; word &= word - 1) {
+                    visit(high | static_cast<uint32_t>(w * 64 + countTrailingZeros(word)));
+                }
+            }
+        }
+    }
+
+    size_t getMemoryBytes() const {
+        size_t bytes = containers.capacity() * sizeof(Container);
+        for (const Container& container : containers) {
+            bytes += container.array.capacity() * sizeof(uint16_t) + container.bits.capacity() * sizeof(uint64_t);
+        }
+        return bytes;
+    }
+};
+
+const size_t RoaringBitmap::kArrayMax;
+const size_t RoaringBitmap::kWords;
+
+// Tag membership as one RoaringBitmap per tag over contact slot indexes,
+// which the slot map keeps dense. Tag names are interned to small ids on
+// first use. Boolean queries such as "vip AND emea AND NOT churned" are
+// evaluated over whole bitmaps, with NOT taken against the bitmap of every
+// contact.
+class TagIndex {
+private:
+    std::unordered_map<std::string, uint32_t> tagIds;
+    std::vector<std::string> tagNames;
+    std::vector<RoaringBitmap> members; // by tag id
+    RoaringBitmap everyone;
+
+    struct Token {
+        std::string text;
+        bool quoted;
+    };
+
+    struct Query {
+        std::vector<Token> tokens;
+        size_t next;
+        std::string error;
+    };
+
+    uint32_t intern(const std::string& tag) {
+        auto entry = tagIds.find(tag);
+        if (entry != tagIds.end()) return entry->second;
+        uint32_t id = static_cast<uint32_t>(tagNames.size());
+        tagIds.emplace(tag, id);
+        tagNames.push_back(tag);
+        members.push_back(RoaringBitmap());
+        return id;
+    }
+
+    // Words, parentheses and double-quoted tags, which may hold spaces
+    static std::vector<Token> tokenize(const std::string& expression) {
+        std::vector<Token> tokens;
+        size_t i = 0;
+        while (i < expression.size()) {
+            char c = expression[i];
+            if (std::isspace(static_cast<unsigned char>(c))) {
+                ++i;
+            } else if (c == '(' || c == ')') {
+                tokens.push_back(Token{std::string(1, c), false});
+                ++i;
+            } else if (c == '"') {
+                size_t close = expression.find('"', i + 1);
+                if (close == std::string::npos) close = expression.size();
+                tokens.push_back(Token{expression.substr(i + 1, close - i - 1), true});
+                i = close + 1;
+            } else {
+                size_t start = i;
+                while (i < expression.size() && !std::isspace(static_cast<unsigned char>(expression[i])) &&
+                       expression[i] != '(' && expression[i] != ')' && expression[i] != '"') {
+                    ++i;
+                }
+                tokens.push_back(Token{expression.substr(start, i - start), false});
+            }
+        }
+        return tokens;
+    }
+
+    // Operators are matched in any case; quote a tag named like one
+    static bool isWord(const Query& query, const char* word) {
+        if (query.next >= query.tokens.size() || query.tokens[query.next].quoted) return false;
+        const std::string& text = query.tokens[query.next].text;
+        size_t length = std::strlen(word);
+        if (text.size() != length) return false;
+        for (size_t i = 0; i < length; ++i) {
+            if (std::toupper(static_cast<unsigned char>(text[i])) != word[i]) return false;
+        }
+        return true;
+    }
+
+    // or := and {OR and}; and := not {[AND] not}; not := NOT not | ( or ) | tag
+    bool parseOr(Query& query, RoaringBitmap& out) const {
+        if (!parseAnd(query, out)) return false;
+        while (isWord(query, "OR")) {
+            ++query.next;
+            RoaringBitmap right;
+            if (!parseAnd(query, right)) return false;
+            out = RoaringBitmap::unite(out, right);
+        }
+        return true;
+    }
+
+    bool parseAnd(Query& query, RoaringBitmap& out) const {
+        if (!parseNot(query, out)) return false;
+        while (query.next < query.tokens.size() && !isWord(query, "OR") && !isWord(query, ")")) {
+            if (isWord(query, "AND")) ++query.next;
+            RoaringBitmap right;
+            if (isWord(query, "NOT")) {
+                // AND NOT subtracts directly instead of building the complement
+                ++query.next;
+                if (!parseNot(query, right)) return false;
+                out = RoaringBitmap::subtract(out, right);
+            } else {
+                if (!parseNot(query, right)) return false;
+                out = RoaringBitmap::intersect(out, right);
+            }
+        }
+        return true;
+    }
+
+    bool parseNot(Query& query, RoaringBitmap& out) const {
+        if (query.next >= query.tokens.size()) {
+            query.error = "expected a tag at the end";
+            return false;
+        }
+        if (isWord(query, "NOT")) {
+            ++query.next;
+            RoaringBitmap inner;
+            if (!parseNot(query, inner)) return false;
+            out = RoaringBitmap::subtract(everyone, inner);
+            return true;
+        }
+        if (isWord(query, "(")) {
+            ++query.next;
+            if (!parseOr(query, out)) return false;
+            if (!isWord(query, ")")) {
+                query.error = "missing ')'";
+                return false;
+            }
+            ++query.next;
+            return true;
+        }
+        if (isWord(query, ")") || isWord(query, "AND") || isWord(query, "OR")) {
+            query.error = "unexpected '" + query.tokens[query.next].text + "'";
+            return false;
+        }
+        const RoaringBitmap* tagged = find(query.tokens[query.next].text);
+        out = tagged ? *tagged : RoaringBitmap();
+        ++query.next;
+        return true;
+    }
+
+public:
+    void clear() {
+        tagIds.clear();
+        tagNames.clear();
+        members.clear();
+        everyone.clear();
+    }
+
+    void addContact(uint32_t slot, const std::vector<std::string>& tags) {
+        everyone.add(slot);
+        for (const auto& tag : tags) addTag(slot, tag);
+    }
+
+    void removeContact(uint32_t slot, const std::vector<std::string>& tags) {
+        everyone.remove(slot);
+        for (const auto& tag : tags) removeTag(slot, tag);
+    }
+
+    void addTag(uint32_t slot, const std::string& tag) {
+        members[intern(tag)].add(slot);
+    }
+
+    void removeTag(uint32_t slot, const std::string& tag) {
+        auto entry = tagIds.find(tag);
+        if (entry != tagIds.end()) members[entry->second].remove(slot);
+    }
+
+    // Null for a tag no contact has ever had
+    const RoaringBitmap* find(const std::string& tag) const {
+        auto entry = tagIds.find(tag);
+        return entry == tagIds.end() ? nullptr : &members[entry->second];
+    }
+
+    // Evaluates a boolean tag expression. On a syntax error returns false
+    // and describes it in error.
+    bool query(const std::string& expression, RoaringBitmap& out, std::string& error) const {
+        Query query{tokenize(expression), 0, std::string()};
+        out.clear();
+        if (query.tokens.empty()) {
+            error = "empty query";
+            return false;
+        }
+        if (!parseOr(query, out)) {
+            error = query.error;
+            return false;
+        }
+        if (query.next < query.tokens.size()) {
+            error = "unexpected '" + query.tokens[query.next].text + "'";
+            return false;
+        }
+        return true;
+    }
+
+    // Calls visit(tag, count) for each tag in use, in the order tags were
+    // first seen
+    template <typename Visit>
+    void forEachTag(Visit visit) const {
+        for (size_t id = 0; id < tagNames.size(); ++id) {
+            if (!members[id].empty()) visit(tagNames[id], members[id].cardinality());
+        }
+    }
+
+    bool empty() const {
+        return std::all_of(members.begin(), members.end(), [](const RoaringBitmap& m) { return m.empty(); });
+    }
+
+    size_t getMemoryBytes() const {
+        size_t bytes = everyone.getMemoryBytes();
+        for (const auto& bitmap : members) bytes += bitmap.getMemoryBytes();
+        return bytes;
+    }
+};
+
+// Inverted index from case-folded trigrams to the ids of contacts whose
+// field contains them. Posting lists are kept sorted, so a substring query
+// intersects the lists of its trigrams, smallest first, and only the
+// surviving candidates need checking against the field itself. Keyed by
+// contact id rather than position so that sorting the contact list leaves
+// it valid.
+class TrigramIndex {
+private:
+    std::unordered_map<uint32_t, std::vector<int>> postings;
+
+    static std::vector<uint32_t> trigramsOf(const std::string& folded) {
+        std::vector<uint32_t> trigrams;
+        for (size_t i = 0; i + 3 <= folded.size(); ++i) {
+            trigrams.push_back((static_cast<uint32_t>(static_cast<unsigned char>(folded[i])) << 16) |
+                               (static_cast<uint32_t>(static_cast<unsigned char>(folded[i + 1])) << 8) |
+                               static_cast<unsigned char>(folded[i + 2]));
+        }
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+        return trigrams;
+    }
+
+public:
+    void clear() {
+        postings.clear();
+    }
+
+    // Texts are passed already case-folded
+    void add(int contactId, const std::string& text) {
+        for (uint32_t trigram : trigramsOf(text)) {
+            std::vector<int>& list = postings[trigram];
+            // Ids are handed out in increasing order, so this is nearly
+            // always an append
+            if (list.empty() || list.back() < contactId) {
+                list.push_back(contactId);
+            } else {
+                auto it = std::lower_bound(list.begin(), list.end(), contactId);
+                if (it == list.end() || *it != contactId) list.insert(it, contactId);
+            }
+        }
+    }
+
+    void remove(int contactId, const std::string& text) {
+        for (uint32_t trigram : trigramsOf(text)) {
+            auto entry = postings.find(trigram);
+            if (entry == postings.end()) continue;
+            std::vector<int>& list = entry->second;
+            auto it = std::lower_bound(list.begin(), list.end(), contactId);
+            if (it != list.end() && *it == contactId) list.erase(it);
+            if (list.empty()) postings.erase(entry);
+        }
+    }
+
+    // Removes a batch of (id, text) entries, filtering each affected posting
+    // list in one merge pass instead of once per contact
+    void removeAll(const std::vector<std::pair<int, const std::string*>>& entries) {
+        std::unordered_map<uint32_t, std::vector<int>> doomed;
+        for (const auto& entry : entries) {
+            for (uint32_t trigram : trigramsOf(*entry.second)) {
+                doomed[trigram].push_back(entry.first);
+            }
+        }
+        for (auto& trigramIds : doomed) {
+            auto entry = postings.find(trigramIds.first);
+            if (entry == postings.end()) continue;
+            std::vector<int>& ids = trigramIds.second;
+            std::sort(ids.begin(), ids.end());
+            std::vector<int>& list = entry->second;
+            size_t kept = 0;
+            size_t next = 0;
+            for (int id : list) {
+                while (next < ids.size() && ids[next] < id) ++next;
+                if (next < ids.size() && ids[next] == id) continue;
+                list[kept++] = id;
+            }
+            list.resize(kept);
+            if (list.empty()) postings.erase(entry);
+        }
+    }
+
+    // Ids of contacts whose field may contain the folded query, in id
+    // order. Returns false if the query is shorter than a trigram, in which
+    // case the caller has to scan.
+    bool candidates(const std::string& foldedQuery, std::vector<int>& out) const {
+        out.clear();
+        std::vector<uint32_t> trigrams = trigramsOf(foldedQuery);
+        if (trigrams.empty()) return false;
+
+        std::vector<const std::vector<int>*> lists;
+        for (uint32_t trigram : trigrams) {
+            auto entry = postings.find(trigram);
+            if (entry == postings.end()) return true;
+            lists.push_back(&entry->second);
+        }
+        std::sort(lists.begin(), lists.end(),
+                  [](const std::vector<int>* a, const std::vector<int>* b) { return a->size() < b->size(); });
+
+        out = *lists[0];
+        for (size_t i = 1; i < lists.size() && !out.empty(); ++i) {
+            const std::vector<int>& list = *lists[i];
+            // Binary search the longer list from the last match onward
+            auto from = list.begin();
+            size_t kept = 0;
+            for (int id : out) {
+                from = std::lower_bound(from, list.end(), id);
+                if (from == list.end()) break;
+                if (*from == id) out[kept++] = id;
+            }
+            out.resize(kept);
+        }
+        return true;
+    }
+
+    // Upper bound on the number of candidates for the folded query: the
+    // length of its shortest posting list. Queries shorter than a trigram
+    // cannot use the index and get SIZE_MAX.
+    size_t estimate(const std::string& foldedQuery) const {
+        std::vector<uint32_t> trigrams = trigramsOf(foldedQuery);
+        if (trigrams.empty()) return SIZE_MAX;
+        size_t shortest = SIZE_MAX;
+        for (uint32_t trigram : trigrams) {
+            auto entry = postings.find(trigram);
+            shortest = std::min(shortest, entry == postings.end() ? 0 : entry->second.size());
+        }
+        return shortest;
+    }
+
+    size_t getTrigramCount() const { return postings.size(); }
+};
+
+// Ranked word search over every text field and tag, scored with BM25 using
+// boosted field weights (a word in the name counts three times, one in the
+// notes half). Each posting stores its term-frequency factor, computed when
+// the contact is indexed, and the postings of a term are split into buckets
+// by that factor. A query visits buckets from the highest impact down and
+// stops once no contact left unseen or partly scored could enter the top k,
+// so a common word only costs its high-impact buckets.
+class FullTextIndex {
+public:
+    struct Hit {
+        int contactId;
+        double score;
+    };
+
+private:
+    static const int kBuckets = 8;
+    static constexpr double kK1 = 1.2;
+    static constexpr double kB = 0.75;
+
+    struct Posting {
+        int contactId;
+        float impact; // tf / (tf + k1 * length norm), in [0, 1)
+    };
+
+    struct Term {
+        std::vector<Posting> buckets[kBuckets];
+        size_t documents;
+        Term() : documents(0) {}
+    };
+
+    struct Document {
+        double length;
+        std::vector<std::pair<std::string, float>> terms; // sorted by term
+    };
+
+    std::unordered_map<std::string, Term> terms;
+    std::unordered_map<int, Document> documents;
+    double totalLength;
+
+    static int bucketOf(float impact) {
+        return std::min(kBuckets - 1, static_cast<int>(impact * kBuckets));
+    }
+
+    double weightOf(const Term& term) const {
+        double n = static_cast<double>(documents.size());
+        double df = static_cast<double>(term.documents);
+        return std::log(1.0 + (n - df + 0.5) / (df + 0.5)) * (kK1 + 1.0);
+    }
+
+    static void addField(const std::string& text, double boost,
+                         std::map<std::string, double>& frequencies, double& length) {
+        std::vector<std::string> words;
+        tokenize(text, words);
+        for (const auto& word : words) {
+            frequencies[word] += boost;
+            length += boost;
+        }
+    }
+
+public:
+    FullTextIndex() : totalLength(0) {}
+
+    // Lowercased runs of letters and digits; bytes above 127 are kept as
+    // word characters so UTF-8 words stay whole
+    static void tokenize(const std::string& text, std::vector<std::string>& out) {
+        std::string word;
+        for (char c : text) {
+            unsigned char byte = static_cast<unsigned char>(c);
+            if (std::isalnum(byte) || byte >= 128) {
+                word.push_back(static_cast<char>(std::tolower(byte)));
+            } else if (!word.empty()) {
+                out.push_back(word);
+                word.clear();
+            }
+        }
+        if (!word.empty()) out.push_back(word);
+    }
+
+    void clear() {
+        terms.clear();
+        documents.clear();
+        totalLength = 0;
+    }
+
+    void add(const Contact& contact) {
+        remove(contact.getContactId());
+
+        std::map<std::string, double> frequencies;
+        double length = 0;
+        addField(contact.getName(), 3.0, frequencies, length);
+        addField(contact.getEmail(), 2.0, frequencies, length);
+        addField(contact.getCompany(), 2.0, frequencies, length);
+        addField(contact.getJobTitle(), 1.5, frequencies, length);
+        addField(contact.getPhone(), 1.0, frequencies, length);
+        addField(contact.getAddress(), 1.0, frequencies, length);
+        addField(contact.getWebsite(), 1.0, frequencies, length);
+        addField(contact.getSocialMedia(), 1.0, frequencies, length);
+        addField(contact.getNotes(), 0.5, frequencies, length);
+        for (const auto& tag : contact.getTags()) {
+            addField(tag, 1.5, frequencies, length);
+        }
+
+        // Impacts use the average length as of indexing; a rebuild at load
+        // brings them back in line
+        totalLength += length;
+        double averageLength = totalLength / (documents.size() + 1);
+        double norm = kK1 * (1.0 - kB + kB * length / averageLength);
+
+        Document& document = documents[contact.getContactId()];
+        document.length = length;
+        document.terms.reserve(frequencies.size());
+        for (const auto& entry : frequencies) {
+            float impact = static_cast<float>(entry.second / (entry.second + norm));
+            Term& term = terms[entry.first];
+            term.buckets[bucketOf(impact)].push_back(Posting{contact.getContactId(), impact});
+            ++term.documents;
+            document.terms.emplace_back(entry.first, impact);
+        }
+    }
+
+    void remove(int contactId) {
+        auto found = documents.find(contactId);
+        if (found == documents.end()) return;
+        for (const auto& entry : found->second.terms) {
+            auto termIt = terms.find(entry.first);
+            if (termIt == terms.end()) continue;
+            std::vector<Posting>& bucket = termIt->second.buckets[bucketOf(entry.second)];
+            for (size_t i = 0; i < bucket.size(); ++i) {
+                if (bucket[i].contactId == contactId) {
+                    bucket[i] = bucket.back();
+                    bucket.pop_back();
+                    break;
+                }
+            }
+            if (--termIt->second.documents == 0) terms.erase(termIt);
+        }
+        totalLength -= found->second.length;
+        documents.erase(found);
+    }
+
+    // Removes a batch of contacts, filtering each affected bucket in one
+    // pass instead of searching it once per contact. Ids must be sorted.
+    void removeAll(const std::vector<int>& contactIds) {
+        std::unordered_map<std::string, unsigned> touchedBuckets;
+        for (int contactId : contactIds) {
+            auto found = documents.find(contactId);
+            if (found == documents.end()) continue;
+            for (const auto& entry : found->second.terms) {
+                touchedBuckets[entry.first] |= 1u << bucketOf(entry.second);
+            }
+            totalLength -= found->second.length;
+            documents.erase(found);
+        }
+        for (const auto& touched : touchedBuckets) {
+            auto termIt = terms.find(touched.first);
+            if (termIt == terms.end()) continue;
+            Term& term = termIt->second;
+            term.documents = 0;
+            for (int b = 0; b < kBuckets; ++b) {
+                std::vector<Posting>& bucket = term.buckets[b];
+                if (touched.second & (1u << b)) {
+                    bucket.erase(std::remove_if(bucket.begin(), bucket.end(), [&contactIds](const Posting& posting) {
+                        return std::binary_search(contactIds.begin(), contactIds.end(), posting.contactId);
+                    }), bucket.end());
+                }
+                term.documents += bucket.size();
+            }
+            if (term.documents == 0) terms.erase(termIt);
+        }
+    }
+
+    // The best `limit` contacts for the query's words, best first
+    std::vector<Hit> search(const std::string& query, size_t limit) const {
+        std::vector<std::string> words;
+        tokenize(query, words);
+        std::sort(words.begin(), words.end());
+        words.erase(std::unique(words.begin(), words.end()), words.end());
+
+        std::vector<std::pair<const Term*, double>> queryTerms;
+        for (const auto& word : words) {
+            auto it = terms.find(word);
+            if (it != terms.end()) queryTerms.emplace_back(&it->second, weightOf(it->second));
+        }
+
+        std::unordered_map<int, double> partial;
+        std::vector<Hit> ranked;
+        auto byScore = [](const Hit& a, const Hit& b) {
+            return a.score > b.score || (a.score == b.score && a.contactId < b.contactId);
+        };
+        for (int level = kBuckets - 1; level >= 0 && limit > 0 && !queryTerms.empty(); --level) {
+            for (const auto& entry : queryTerms) {
+                for (const Posting& posting : entry.first->buckets[level]) {
+                    partial[posting.contactId] += entry.second * posting.impact;
+                }
+            }
+
+            // Any posting still unvisited has impact below level / kBuckets
+            double remaining = 0;
+            for (const auto& entry : queryTerms) remaining += entry.second * level / kBuckets;
+
+            ranked.clear();
+            for (const auto& entry : partial) ranked.push_back(Hit{entry.first, entry.second});
+            if (ranked.size() <= limit) {
+                if (remaining == 0) break;
+                continue;
+            }
+            std::nth_element(ranked.begin(), ranked.begin() + limit, ranked.end(), byScore);
+            double kth = std::min_element(ranked.begin(), ranked.begin() + limit, byScore)->score;
+            double bestOutside = std::max_element(ranked.begin() + limit, ranked.end(),
+                [](const Hit& a, const Hit& b) { return a.score < b.score; })->score;
+            // Nothing outside the top k, seen or not, can still overtake it
+            if (bestOutside + remaining <= kth) break;
+        }
+
+        if (ranked.size() > limit) ranked.resize(limit);
+        // Finish the scores of the winners from their own term lists
+        for (Hit& hit : ranked) {
+            const Document& document = documents.at(hit.contactId);
+            hit.score = 0;
+            for (size_t i = 0; i < words.size(); ++i) {
+                auto termIt = terms.find(words[i]);
+                if (termIt == terms.end()) continue;
+                auto it = std::lower_bound(document.terms.begin(), document.terms.end(), words[i],
+                    [](const std::pair<std::string, float>& a, const std::string& b) { return a.first < b; });
+                if (it != document.terms.end() && it->first == words[i]) {
+                    hit.score += weightOf(termIt->second) * it->second;
+                }
+            }
+        }
+        std::sort(ranked.begin(), ranked.end(), byScore);
+        return ranked;
+    }
+
+    size_t getTermCount() const { return terms.size(); }
+};
+
+const int FullTextIndex::kBuckets;
+constexpr double FullTextIndex::kK1;
+constexpr double FullTextIndex::kB;
+
+// Typo-tolerant lookup of name words. A BK-tree over the distinct folded
+// words of every name, each node holding the ids of the contacts whose name
+// uses its word. Edit distance obeys the triangle inequality, so below a
+// node at distance d from the query only the children filed under
+// distances d-k..d+k can hold a word within k edits, and most of the tree
+// is never visited. A BK-tree cannot unlink a node, so a word no contact
+// uses any more stays behind as an empty routing node until the empty ones
+// outnumber the rest and the tree is rebuilt without them.
+class FuzzyNameIndex {
+public:
+    struct Match {
+        int contactId;
+        int distance; // edits summed over the query words
+    };
+
+private:
+    struct Node {
+        std::string word;
+        std::vector<int> ids;
+        std::vector<std::pair<int, uint32_t>> children; // (distance, node)
+    };
+    std::vector<Node> nodes; // nodes[0] is the root
+    std::unordered_map<std::string, uint32_t> words;
+    size_t emptyWords;
+
+    static const size_t kMinRebuildNodes = 1024;
+
+    void insertWord(const std::string& word, std::vector<int>&& ids) {
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(Node());
+        nodes.back().word = word;
+        nodes.back().ids = std::move(ids);
+        words[word] = index;
+        if (index == 0) return;
+
+        std::vector<int> row;
+        uint32_t node = 0;
+        while (true) {
+            int distance = editDistance(word, nodes[node].word, row);
+            std::vector<std::pair<int, uint32_t>>& children = nodes[node].children;
+            auto child = std::find_if(children.begin(), children.end(),
+                [distance](const std::pair<int, uint32_t>& c) { return c.first == distance; });
+            if (child == children.end()) {
+                children.emplace_back(distance, index);
+                return;
+            }
+            node = child->second;
+        }
+    }
+
+    void rebuildIfSparse() {
+        if (nodes.size() < kMinRebuildNodes || emptyWords * 2 <= nodes.size()) return;
+        std::vector<Node> old;
+        old.swap(nodes);
+        words.clear();
+        emptyWords = 0;
+        for (Node& node : old) {
+            if (!node.ids.empty()) insertWord(node.word, std::move(node.ids));
+        }
+    }
+
+    // Nodes with contacts whose word is within maxDistance of the query
+    // word, closest first
+    void within(const std::string& word, int maxDistance, std::vector<std::pair<int, uint32_t>>& out) const {
+        out.clear();
+        std::vector<uint32_t> stack(1, 0);
+        std::vector<int> row;
+        while (!stack.empty()) {
+            uint32_t index = stack.back();
+            stack.pop_back();
+            const Node& node = nodes[index];
+            int distance = editDistance(word, node.word, row);
+            if (distance <= maxDistance && !node.ids.empty()) out.emplace_back(distance, index);
+            for (const auto& child : node.children) {
+                if (child.first >= distance - maxDistance && child.first <= distance + maxDistance) {
+                    stack.push_back(child.second);
+                }
+            }
+        }
+        std::sort(out.begin(), out.end());
+    }
+
+public:
+    FuzzyNameIndex() : emptyWords(0) {}
+
+    // Levenshtein distance over one row of the table, after trimming the
+    // common prefix and suffix
+    static int editDistance(const std::string& a, const std::string& b, std::vector<int>& row) {
+        size_t start = 0;
+        size_t endA = a.size();
+        size_t endB = b.size();
+        while (start < endA && start < endB && a[start] == b[start]) ++start;
+        while (endA > start && endB > start && a[endA - 1] == b[endB - 1]) { --endA; --endB; }
+        size_t lengthA = endA - start;
+        size_t lengthB = endB - start;
+        if (lengthA == 0) return static_cast<int>(lengthB);
+        if (lengthB == 0) return static_cast<int>(lengthA);
+
+        row.resize(lengthB + 1);
+        for (size_t j = 0; j <= lengthB; ++j) row[j] = static_cast<int>(j);
+        for (size_t i = 1; i <= lengthA; ++i) {
+            int diagonal = row[0];
+            row[0] = static_cast<int>(i);
+            char c = a[start + i - 1];
+            for (size_t j = 1; j <= lengthB; ++j) {
+                int above = row[j];
+                int substitute = diagonal + (c != b[start + j - 1] ? 1 : 0);
+                row[j] = std::min(std::min(above, row[j - 1]) + 1, substitute);
+                diagonal = above;
+            }
+        }
+        return row[lengthB];
+    }
+
+    void clear() {
+        nodes.clear();
+        words.clear();
+        emptyWords = 0;
+    }
+
+    // Names are passed already case-folded
+    void add(int contactId, const std::string& name) {
+        std::vector<std::string> nameWords;
+        FullTextIndex::tokenize(name, nameWords);
+        for (const auto& word : nameWords) {
+            auto entry = words.find(word);
+            if (entry == words.end()) {
+                insertWord(word, std::vector<int>(1, contactId));
+                continue;
+            }
+            std::vector<int>& ids = nodes[entry->second].ids;
+            if (ids.empty()) --emptyWords;
+            if (ids.empty() || ids.back() < contactId) {
+                ids.push_back(contactId);
+            } else {
+                auto it = std::lower_bound(ids.begin(), ids.end(), contactId);
+                if (it == ids.end() || *it != contactId) ids.insert(it, contactId);
+            }
+        }
+    }
+
+    void remove(int contactId, const std::string& name) {
+        std::vector<std::string> nameWords;
+        FullTextIndex::tokenize(name, nameWords);
+        for (const auto& word : nameWords) {
+            auto entry = words.find(word);
+            if (entry == words.end()) continue;
+            std::vector<int>& ids = nodes[entry->second].ids;
+            auto it = std::lower_bound(ids.begin(), ids.end(), contactId);
+            if (it == ids.end() || *it != contactId) continue;
+            ids.erase(it);
+            if (ids.empty()) ++emptyWords;
+        }
+        rebuildIfSparse();
+    }
+
+    // Batch form of remove, filtering each word's id list once
+    void removeAll(const std::vector<std::pair<int, const std::string*>>& entries) {
+        std::unordered_map<uint32_t, std::vector<int>> doomed;
+        std::vector<std::string> nameWords;
+        for (const auto& entry : entries) {
+            nameWords.clear();
+            FullTextIndex::tokenize(*entry.second, nameWords);
+            for (const auto& word : nameWords) {
+                auto found = words.find(word);
+                if (found != words.end()) doomed[found->second].push_back(entry.first);
+            }
+        }
+        for (auto& nodeIds : doomed) {
+            std::vector<int>& ids = nodes[nodeIds.first].ids;
+            if (ids.empty()) continue;
+            std::vector<int>& gone = nodeIds.second;
+            std::sort(gone.begin(), gone.end());
+            ids.erase(std::remove_if(ids.begin(), ids.end(), [&gone](int id) {
+                return std::binary_search(gone.begin(), gone.end(), id);
+            }), ids.end());
+            if (ids.empty()) ++emptyWords;
+        }
+        rebuildIfSparse();
+    }
+
+    // Contacts whose name has, for every word of the query, a word within
+    // maxTypos edits of it, fewest edits first and then by id. A query word
+    // allows at most half its length in edits so that short words do not
+    // match every short name.
+    void search(const std::string& query, int maxTypos, std::vector<Match>& out) const {
+        out.clear();
+        std::vector<std::string> queryWords;
+        FullTextIndex::tokenize(query, queryWords);
+        if (queryWords.empty() || nodes.empty()) return;
+
+        std::vector<std::vector<std::pair<int, uint32_t>>> hits(queryWords.size());
+        size_t seed = 0;
+        size_t seedIds = 0;
+        for (size_t w = 0; w < queryWords.size(); ++w) {
+            int allowed = std::min(maxTypos, static_cast<int>(queryWords[w].size() / 2));
+            within(queryWords[w], allowed, hits[w]);
+            size_t total = 0;
+            for (const auto& hit : hits[w]) total += nodes[hit.second].ids.size();
+            if (total == 0) return;
+            if (w == 0 || total < seedIds) {
+                seed = w;
+                seedIds = total;
+            }
+        }
+
+        // Candidates come from the rarest query word; the other words only
+        // check them against their own matching words' id lists
+        out.reserve(seedIds);
+        for (const auto& hit : hits[seed]) {
+            for (int id : nodes[hit.second].ids) out.push_back(Match{id, hit.first});
+        }
+        auto byId = [](const Match& a, const Match& b) {
+            return a.contactId != b.contactId ? a.contactId < b.contactId : a.distance < b.distance;
+        };
+        std::sort(out.begin(), out.end(), byId);
+        out.erase(std::unique(out.begin(), out.end(), [](const Match& a, const Match& b) {
+            return a.contactId == b.contactId;
+        }), out.end());
+
+        for (size_t w = 0; w < queryWords.size(); ++w) {
+            if (w == seed) continue;
+            size_t kept = 0;
+            for (const Match& match : out) {
+                for (const auto& hit : hits[w]) {
+                    const std::vector<int>& ids = nodes[hit.second].ids;
+                    if (std::binary_search(ids.begin(), ids.end(), match.contactId)) {
+                        out[kept] = match;
+                        out[kept++].distance += hit.first;
+                        break;
+                    }
+                }
+            }
+            out.resize(kept);
+        }
+        std::sort(out.begin(), out.end(), [](const Match& a, const Match& b) {
+            return a.distance != b.distance ? a.distance < b.distance : a.contactId < b.contactId;
+        });
+    }
+
+    size_t getWordCount() const { return words.size() - emptyWords; }
+};
+
+const size_t FuzzyNameIndex::kMinRebuildNodes;
+
+// "Sounds like" lookup of names: every name word is filed under its
+// Metaphone code, so Jon and John (JN) or Smyth and Smith (SM0) share a
+// posting list. The code's first twelve sounds are packed five bits each
+// into the hash key, so longer codes that agree that far share a key; a
+// query word with such a code has its candidates verified against the
+// full code of their names.
+class PhoneticIndex {
+private:
+    std::unordered_map<uint64_t, std::vector<int>> postings;
+
+    static bool isVowel(char c) {
+        return c == 'A' || c == 'E' || c == 'I' || c == 'O' || c == 'U';
+    }
+
+    static std::vector<uint64_t> keysOf(const std::string& name) {
+        std::vector<std::string> nameWords;
+        FullTextIndex::tokenize(name, nameWords);
+        std::vector<uint64_t> keys;
+        for (const auto& word : nameWords) {
+            uint64_t key = keyOf(word);
+            if (key != 0) keys.push_back(key);
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        return keys;
+    }
+
+public:
+    // Lawrence Philips' original Metaphone over the ASCII letters of a
+    // word; '0' stands for "th"
+    static std::string metaphone(const std::string& word) {
+        std::string w;
+        for (char c : word) {
+            unsigned char byte = static_cast<unsigned char>(c);
+            if (byte < 128 && std::isalpha(byte)) w.push_back(static_cast<char>(std::toupper(byte)));
+        }
+        std::string code;
+        if (w.empty()) return code;
+        auto at = [&w](size_t i) { return i < w.size() ? w[i] : '\0'; };
+
+        size_t start = 0;
+        std::string opening = w.substr(0, 2);
+        if (opening == "AE" || opening == "GN" || opening == "KN" || opening == "PN" || opening == "WR") {
+            start = 1;
+        } else if (w[0] == 'X') {
+            code.push_back('S');
+            start = 1;
+        } else if (opening == "WH") {
+            code.push_back('W');
+            start = 2;
+        }
+
+        for (size_t i = start; i < w.size(); ++i) {
+            char c = w[i];
+            char prev = i > 0 ? w[i - 1] : '\0';
+            char next = at(i + 1);
+            char after = at(i + 2);
+            if (c == prev && c != 'C') continue;
+            bool soft = next == 'E' || next == 'I' || next == 'Y';
+            switch (c) {
+                case 'A': case 'E': case 'I': case 'O': case 'U':
+                    // Only a vowel starting the word is sounded
+                    if (i == start && code.empty()) code.push_back(c);
+                    break;
+                case 'B':
+                    if (!(prev == 'M' && i + 1 == w.size())) code.push_back('B');
+                    break;
+                case 'C':
+                    if (next == 'I' && after == 'A') code.push_back('X');
+                    else if (next == 'H') code.push_back(prev == 'S' ? 'K' : 'X');
+                    else if (soft) { if (prev != 'S') code.push_back('S'); }
+                    else code.push_back('K');
+                    break;
+                case 'D':
+                    code.push_back(next == 'G' && (after == 'E' || after == 'I' || after == 'Y') ? 'J' : 'T');
+                    break;
+                case 'G':
+                    if (next == 'H' && !isVowel(after)) break;
+                    if (next == 'N' && (i + 2 == w.size() || (after == 'E' && at(i + 3) == 'D' && i + 4 == w.size()))) break;
+                    if (prev == 'D' && soft) break;
+                    code.push_back(soft && prev != 'G' ? 'J' : 'K');
+                    break;
+                case 'H':
+                    if (isVowel(prev) && !isVowel(next)) break;
+                    if (prev == 'C' || prev == 'S' || prev == 'P' || prev == 'T' || prev == 'G') break;
+                    code.push_back('H');
+                    break;
+                case 'K':
+                    if (prev != 'C') code.push_back('K');
+                    break;
+                case 'P':
+                    code.push_back(next == 'H' ? 'F' : 'P');
+                    break;
+                case 'Q':
+                    code.push_back('K');
+                    break;
+                case 'S':
+                    if (next == 'H' || (next == 'I' && (after == 'O' || after == 'A'))) code.push_back('X');
+                    else code.push_back('S');
+                    break;
+                case 'T':
+                    if (next == 'I' && (after == 'O' || after == 'A')) code.push_back('X');
+                    else if (next == 'H') code.push_back('0');
+                    else if (!(next == 'C' && after == 'H')) code.push_back('T');
+                    break;
+                case 'V':
+                    code.push_back('F');
+                    break;
+                case 'W': case 'Y':
+                    if (isVowel(next)) code.push_back(c);
+                    break;
+                case 'X':
+                    code += "KS";
+                    break;
+                case 'Z':
+                    code.push_back('S');
+                    break;
+                default:
+                    code.push_back(c);
+            }
+        }
+        return code;
+    }
+
+    // The packed code of a word, or 0 for a word without letters
+    static uint64_t keyOf(const std::string& word) {
+        static const char kSymbols[] = "AEIOUBFHJKLMNPRSTWXY0";
+        std::string code = metaphone(word);
+        uint64_t key = 0;
+        for (size_t i = 0; i < code.size() && i < 12; ++i) {
+            key = (key << 5) | static_cast<uint64_t>(std::strchr(kSymbols, code[i]) - kSymbols + 1);
+        }
+        return key;
+    }
+
+    void clear() {
+        postings.clear();
+    }
+
+    // Names are passed already case-folded
+    void add(int contactId, const std::string& name) {
+        for (uint64_t key : keysOf(name)) {
+            std::vector<int>& list = postings[key];
+            if (list.empty() || list.back() < contactId) {
+                list.push_back(contactId);
+            } else {
+                auto it = std::lower_bound(list.begin(), list.end(), contactId);
+                if (it == list.end() || *it != contactId) list.insert(it, contactId);
+            }
+        }
+    }
+
+    void remove(int contactId, const std::string& name) {
+        for (uint64_t key : keysOf(name)) {
+            auto entry = postings.find(key);
+            if (entry == postings.end()) continue;
+            std::vector<int>& list = entry->second;
+            auto it = std::lower_bound(list.begin(), list.end(), contactId);
+            if (it != list.end() && *it == contactId) list.erase(it);
+            if (list.empty()) postings.erase(entry);
+        }
+    }
+
+    // Batch form of remove, filtering each posting list once
+    void removeAll(const std::vector<std::pair<int, const std::string*>>& entries) {
+        std::unordered_map<uint64_t, std::vector<int>> doomed;
+        for (const auto& entry : entries) {
+            for (uint64_t key : keysOf(*entry.second)) doomed[key].push_back(entry.first);
+        }
+        for (auto& keyIds : doomed) {
+            auto entry = postings.find(keyIds.first);
+            if (entry == postings.end()) continue;
+            std::vector<int>& gone = keyIds.second;
+            std::sort(gone.begin(), gone.end());
+            std::vector<int>& list = entry->second;
+            list.erase(std::remove_if(list.begin(), list.end(), [&gone](int id) {
+                return std::binary_search(gone.begin(), gone.end(), id);
+            }), list.end());
+            if (list.empty()) postings.erase(entry);
+        }
+    }
+
+    // Ids, in id order, of contacts with a name word sounding like each
+    // word of the query: one probe per query word, then an intersection.
+    // nameOf(id) gives the folded name, or null, for verifying query words
+    // whose codes are too long for the key.
+    template <typename NameOf>
+    void search(const std::string& query, std::vector<int>& out, NameOf nameOf) const {
+        out.clear();
+        std::vector<std::string> queryWords;
+        FullTextIndex::tokenize(query, queryWords);
+        std::vector<std::string> longCodes;
+        for (const auto& word : queryWords) {
+            std::string code = metaphone(word);
+            if (code.size() > 12) longCodes.push_back(code);
+        }
+        std::vector<const std::vector<int>*> lists;
+        for (uint64_t key : keysOf(query)) {
+            auto entry = postings.find(key);
+            if (entry == postings.end()) return;
+            lists.push_back(&entry->second);
+        }
+        if (lists.empty()) return;
+        std::sort(lists.begin(), lists.end(),
+                  [](const std::vector<int>* a, const std::vector<int>* b) { return a->size() < b->size(); });
+        out = *lists[0];
+        for (size_t i = 1; i < lists.size() && !out.empty(); ++i) {
+            const std::vector<int>& list = *lists[i];
+            out.erase(std::remove_if(out.begin(), out.end(), [&list](int id) {
+                return !std::binary_search(list.begin(), list.end(), id);
+            }), out.end());
+        }
+        if (longCodes.empty()) return;
+        out.erase(std::remove_if(out.begin(), out.end(), [&longCodes, &nameOf](int id) {
+            const std::string* name = nameOf(id);
+            if (!name) return true;
+            std::vector<std::string> nameWords;
+            FullTextIndex::tokenize(*name, nameWords);
+            std::vector<std::string> codes;
+            for (const auto& word : nameWords) codes.push_back(metaphone(word));
+            for (const auto& code : longCodes) {
+                if (std::find(codes.begin(), codes.end(), code) == codes.end()) return true;
+            }
+            return false;
+        }), out.end());
+    }
+
+    size_t getKeyCount() const { return postings.size(); }
+};
+
+// Contacts by email domain. Domains are keyed with their labels reversed,
+// sales.acme.com as com.acme.sales, so in the sorted map an organization's
+// subdomains all follow it in one range: everything from "com.acme." up to
+// "com.acme/", '/' being the character after '.'. The local part of an
+// email is left to the email trigram index.
+class EmailDomainIndex {
+private:
+    std::map<std::string, std::vector<int>> domains;
+
+public:
+    // "sales.acme.com" becomes "com.acme.sales" and back again
+    static std::string reverseLabels(const std::string& domain) {
+        std::string reversed;
+        reversed.reserve(domain.size());
+        size_t end = domain.size();
+        while (end > 0) {
+            size_t dot = domain.rfind('.', end - 1);
+            size_t start = dot == std::string::npos ? 0 : dot + 1;
+            if (!reversed.empty()) reversed.push_back('.');
+            reversed.append(domain, start, end - start);
+            if (dot == std::string::npos) break;
+            end = dot;
+        }
+        return reversed;
+    }
+
+    // Reversed domain of a folded email, or of a bare domain with or
+    // without a leading '@'. Empty when there is none.
+    static std::string domainKey(const std::string& folded) {
+        size_t at = folded.rfind('@');
+        std::string domain = at == std::string::npos ? folded : folded.substr(at + 1);
+        while (!domain.empty() && domain.back() == '.') domain.pop_back();
+        return reverseLabels(domain);
+    }
+
+    // Calls visit(key, value) for the entry of a reversed domain and for
+    // each of its subdomains. Shared with Statistics, which keeps its
+    // per-domain counts under the same keys.
+    template <typename Value, typename Visit>
+    static void visitRange(const std::map<std::string, Value>& map, const std::string& key, Visit visit) {
+        if (key.empty()) return;
+        auto exact = map.find(key);
+        if (exact != map.end()) visit(exact->first, exact->second);
+        auto end = map.lower_bound(key + "/");
+        for (auto it = map.lower_bound(key + "."); it != end; ++it) visit(it->first, it->second);
+    }
+
+    void clear() {
+        domains.clear();
+    }
+
+    void add(int contactId, const std::string& foldedEmail) {
+        if (foldedEmail.find('@') == std::string::npos) return;
+        std::string key = domainKey(foldedEmail);
+        if (key.empty()) return;
+        std::vector<int>& ids = domains[key];
+        if (ids.empty() || ids.back() < contactId) {
+            ids.push_back(contactId);
+        } else {
+            auto it = std::lower_bound(ids.begin(), ids.end(), contactId);
+            if (it == ids.end() || *it != contactId) ids.insert(it, contactId);
+        }
+    }
+
+    void remove(int contactId, const std::string& foldedEmail) {
+        if (foldedEmail.find('@') == std::string::npos) return;
+        auto entry = domains.find(domainKey(foldedEmail));
+        if (entry == domains.end()) return;
+        std::vector<int>& ids = entry->second;
+        auto it = std::lower_bound(ids.begin(), ids.end(), contactId);
+        if (it != ids.end() && *it == contactId) ids.erase(it);
+        if (ids.empty()) domains.erase(entry);
+    }
+
+    // Batch form of remove, filtering each domain's id list once
+    void removeAll(const std::vector<std::pair<int, const std::string*>>& entries) {
+        std::map<std::string, std::vector<int>> doomed;
+        for (const auto& entry : entries) {
+            if (entry.second->find('@') != std::string::npos) doomed[domainKey(*entry.second)].push_back(entry.first);
+        }
+        for (auto& domainIds : doomed) {
+            auto entry = domains.find(domainIds.first);
+            if (entry == domains.end()) continue;
+            std::vector<int>& gone = domainIds.second;
+            std::sort(gone.begin(), gone.end());
+            std::vector<int>& ids = entry->second;
+            ids.erase(std::remove_if(ids.begin(), ids.end(), [&gone](int id) {
+                return std::binary_search(gone.begin(), gone.end(), id);
+            }), ids.end());
+            if (ids.empty()) domains.erase(entry);
+        }
+    }
+
+    // Ids, in id order, of contacts at the folded domain or any of its
+    // subdomains
+    void find(const std::string& foldedDomain, std::vector<int>& out) const {
+        out.clear();
+        size_t lists = 0;
+        visitRange(domains, domainKey(foldedDomain), [&out, &lists](const std::string&, const std::vector<int>& ids) {
+            out.insert(out.end(), ids.begin(), ids.end());
+            ++lists;
+        });
+        if (lists > 1) std::sort(out.begin(), out.end());
+    }
+
+    size_t getDomainCount() const { return domains.size(); }
+};
+
+// Contacts by birthday in calendar order: a bucket of ids per month and
+// day at month * 32 + day. The birthdays of the coming days are read
+// bucket by bucket from today's, wrapping from December 31 to January 1,
+// so a window costs the days it spans plus its results whatever the
+// number of contacts. February 29 birthdays fall on March 1 in common
+// years.
+class BirthdayIndex {
+private:
+    static const int kFirstKey = 32; // January 1 is 1 * 32 + 1
+    static const int kKeys = 13 * 32;
+    std::vector<std::vector<int>> buckets;
+    size_t count;
+    uint64_t version; // bumped by every change, so reports built from the index can tell they are stale
+
+    static int keyOf(const BirthDate& date) {
+        return date.month * 32 + date.day;
+    }
+
+public:
+    struct Upcoming {
+        int contactId;
+        int daysUntil;
+        int year; // of the birthday reached
+    };
+
+    BirthdayIndex() : buckets(kKeys), count(0), version(0) {}
+
+    void clear() {
+        for (auto& ids : buckets) ids.clear();
+        count = 0;
+        ++version;
+    }
+
+    void add(int contactId, const BirthDate& date) {
+        if (!date.isSet()) return;
+        std::vector<int>& ids = buckets[keyOf(date)];
+        if (ids.empty() || ids.back() < contactId) {
+            ids.push_back(contactId);
+        } else {
+            auto it = std::lower_bound(ids.begin(), ids.end(), contactId);
+            if (it != ids.end() && *it == contactId) return;
+            ids.insert(it, contactId);
+        }
+        ++count;
+        ++version;
+    }
+
+    void remove(int contactId, const BirthDate& date) {
+        if (!date.isSet()) return;
+        std::vector<int>& ids = buckets[keyOf(date)];
+        auto it = std::lower_bound(ids.begin(), ids.end(), contactId);
+        if (it == ids.end() || *it != contactId) return;
+        ids.erase(it);
+        --count;
+        ++version;
+    }
+
+    // Batch form of remove, filtering each day's id list once
+    void removeAll(const std::vector<std::pair<int, BirthDate>>& entries) {
+        std::map<int, std::vector<int>> doomed;
+        for (const auto& entry : entries) {
+            if (entry.second.isSet()) doomed[keyOf(entry.second)].push_back(entry.first);
+        }
+        for (auto& dayIds : doomed) {
+            std::vector<int>& gone = dayIds.second;
+            std::sort(gone.begin(), gone.end());
+            std::vector<int>& ids = buckets[dayIds.first];
+            size_t before = ids.size();
+            ids.erase(std::remove_if(ids.begin(), ids.end(), [&gone](int id) {
+                return std::binary_search(gone.begin(), gone.end(), id);
+            }), ids.end());
+            count -= before - ids.size();
+        }
+        if (!doomed.empty()) ++version;
+    }
+
+    // Birthdays from the given date through the following `days` days,
+    // soonest first and by id within a day. On March 1 of a common year
+    // the February 29 birthdays come first.
+    void upcoming(int year, int month, int day, int days, std::vector<Upcoming>& out) const {
+        out.clear();
+        if (days < 0) return;
+        int today = BirthDate::dayNumber(year, month, day);
+        int start = month * 32 + day;
+        // On March 1 of a common year the February 29 birthdays fall today
+        if (month == 3 && day == 1 && !BirthDate::isLeapYear(year)) start = 2 * 32 + 29;
+        for (int step = 0; step < kKeys - kFirstKey; ++step) {
+            int key = kFirstKey + (start - kFirstKey + step) % (kKeys - kFirstKey);
+            const std::vector<int>& ids = buckets[key];
+            if (ids.empty()) continue;
+            int reached = key >= start ? year : year + 1;
+            int daysUntil = BirthDate::dayNumber(reached, key / 32, key % 32) - today;
+            if (daysUntil > days) break;
+            for (int id : ids) out.push_back(Upcoming{id, daysUntil, reached});
+        }
+    }
+
+    size_t size() const { return count; }
+    uint64_t getVersion() const { return version; }
+};
+
+class Statistics {
+private:
+    std::map<std::string, int> tagCounts;
+    std::map<std::string, int> companyCounts;
+    std::map<std::string, int> domainCounts; // keyed by reversed domain
+    int totalContacts;
+    int favoritesCount;
+    
+    static void decrement(std::map<std::string, int>& counts, const std::string& key) {
+        auto it = counts.find(key);
+        if (it != counts.end() && --it->second <= 0) counts.erase(it);
+    }
+    
+public:
+    Statistics() : totalContacts(0), favoritesCount(0) {}
+    
+    // Full recount, used at load
+    template <typename ContactList>
+    void update(const ContactList& contacts) {
+        totalContacts = 0;
+        tagCounts.clear();
+        companyCounts.clear();
+        domainCounts.clear();
+        favoritesCount = 0;
+        
+        for (const auto& contact : contacts) {
+            add(contact);
+        }
+    }
+    
+    // Incremental upkeep. A change to a contact is a remove of its old
+    // state followed by an add of the new one.
+    void add(const Contact& contact) {
+        totalContacts++;
+        if (contact.getIsFavorite()) {
+            favoritesCount++;
+        }
+        
+        if (!contact.getCompany().empty()) {
+            companyCounts[contact.getCompany()]++;
+        }
+        
+        if (contact.getFoldedEmail().find('@') != std::string::npos) {
+            domainCounts[EmailDomainIndex::domainKey(contact.getFoldedEmail())]++;
+        }
+        
+        for (const auto& tag : contact.getTags()) {
+            tagCounts[tag]++;
+        }
+    }
+    
+    void remove(const Contact& contact) {
+        totalContacts--;
+        if (contact.getIsFavorite()) {
+            favoritesCount--;
+        }
+        
+        if (!contact.getCompany().empty()) {
+            decrement(companyCounts, contact.getCompany());
+        }
+        
+        if (contact.getFoldedEmail().find('@') != std::string::npos) {
+            decrement(domainCounts, EmailDomainIndex::domainKey(contact.getFoldedEmail()));
+        }
+        
+        for (const auto& tag : contact.getTags()) {
+            decrement(tagCounts, tag);
+        }
+    }
+    
+    int getTotalContacts() const { return totalContacts; }
+    int getFavoritesCount() const { return favoritesCount; }
+    
+    // Contacts with an email at the domain or any of its subdomains, so
+    // "acme.com" counts the whole organization
+    int countAtDomain(const std::string& domain) const {
+        int count = 0;
+        EmailDomainIndex::visitRange(domainCounts, EmailDomainIndex::domainKey(Contact::foldCase(domain)),
+            [&count](const std::string&, int domainCount) { count += domainCount; });
+        return count;
+    }
+    
+    void display() const {
+        std::cout << "\n=== STATISTICS ===\n";
+        std::cout << "Total Contacts: " << totalContacts << std::endl;
+        std::cout << "Favorites: " << favoritesCount << std::endl;
+        
+        if (!companyCounts.empty()) {
+            std::cout << "\nCompanies:\n";
+            for (const auto& entry : companyCounts) {
+                std::cout << "  " << entry.first << ": " << entry.second << std::endl;
+            }
+        }
+        
+        if (!domainCounts.empty()) {
+            const size_t kTopDomains = 10;
+            std::vector<std::pair<std::string, int>> top(domainCounts.begin(), domainCounts.end());
+            size_t shown = std::min(kTopDomains, top.size());
+            std::partial_sort(top.begin(), top.begin() + shown, top.end(),
+                [](const std::pair<std::string, int>& a, const std::pair<std::string, int>& b) {
+                    return a.second > b.second;
+                });
+            std::cout << "\nEmail Domains (top " << shown << " of " << top.size() << "):\n";
+            for (size_t i = 0; i < shown; ++i) {
+                std::cout << "  " << EmailDomainIndex::reverseLabels(top[i].first) << ": " << top[i].second << std::endl;
+            }
+        }
+        
+        if (!tagCounts.empty()) {
+            std::cout << "\nTags:\n";
+            for (const auto& entry : tagCounts) {
+                std::cout << "  " << entry.first << ": " << entry.second << std::endl;
+            }
+        }
+    }
+};
+
+// A combined search in which every predicate has to hold, written as
+// space-separated terms:
+//   company:acme tag:vip -tag:churned favorite modified>=2025-01-01
+// name:, email:, company:, address:, job:, notes:, website: and social:
+// match a case-insensitive substring; phone: takes an exact number or
+// 555*, *1234 and *555* for numbers starting with, ending with or
+// containing digits; domain: matches an email domain and its
+// subdomains; created, modified and birthday compare with a YYYY-MM-DD
+// date using =, <, <=, > or >=. Values with spaces go in double quotes.
+class ContactQuery {
+public:
+    struct Predicate {
+        enum Kind { Text, Phone, Domain, Tag, Favorite, Created, Modified, Birthday };
+        Kind kind;
+        std::string term;  // as written, for explain
+        std::string value; // folded text, phone query, folded domain, tag or date
+        const std::string& (Contact::*field)() const;
+        bool negated;      // -tag: and -favorite
+        std::string op;    // date comparison
+        std::time_t from;  // created and modified match [from, to)
+        std::time_t to;
+    };
+    std::vector<Predicate> predicates;
+
+private:
+    static std::vector<std::string> split(const std::string& text) {
+        std::vector<std::string> terms;
+        std::string term;
+        bool quoted = false;
+        for (char c : text) {
+            if (c == '"') {
+                quoted = !quoted;
+            } else if (!quoted && std::isspace(static_cast<unsigned char>(c))) {
+                if (!term.empty()) terms.push_back(term);
+                term.clear();
+            } else {
+                term.push_back(c);
+            }
+        }
+        if (!term.empty()) terms.push_back(term);
+        return terms;
+    }
+
+    // Local midnight starting the given date, days later
+    static std::time_t dayStart(const std::string& date, int days) {
+        std::tm day = {};
+        day.tm_year = std::atoi(date.substr(0, 4).c_str()) - 1900;
+        day.tm_mon = std::atoi(date.substr(5, 2).c_str()) - 1;
+        day.tm_mday = std::atoi(date.substr(8, 2).c_str()) + days;
+        day.tm_isdst = -1;
+        return std::mktime(&day);
+    }
+
+    static bool parseDate(Predicate& predicate, const std::string& op, const std::string& date, std::string& error) {
+        // mktime would quietly roll 2025-13-01 over into the next year
+        if (date.empty() || !InputValidator::isValidDate(date) ||
+            std::atoi(date.substr(5, 2).c_str()) < 1 || std::atoi(date.substr(5, 2).c_str()) > 12 ||
+            std::atoi(date.substr(8, 2).c_str()) < 1 || std::atoi(date.substr(8, 2).c_str()) > 31) {
+            error = "'" + predicate.term + "' needs a YYYY-MM-DD date";
+            return false;
+        }
+        predicate.op = op;
+        predicate.value = date;
+        predicate.from = std::numeric_limits<std::time_t>::min();
+        predicate.to = std::numeric_limits<std::time_t>::max();
+        if (op == "=" || op == ">=") predicate.from = dayStart(date, 0);
+        if (op == ">") predicate.from = dayStart(date, 1);
+        if (op == "=" || op == "<=") predicate.to = dayStart(date, 1);
+        if (op == "<") predicate.to = dayStart(date, 0);
+        return true;
+    }
+
+    static bool parseTerm(const std::string& term, Predicate& predicate, std::string& error) {
+        predicate.term = term;
+        predicate.field = nullptr;
+        predicate.negated = false;
+        predicate.from = predicate.to = 0;
+        std::string body = term;
+        if (body.size() > 1 && body[0] == '-') {
+            predicate.negated = true;
+            body.erase(0, 1);
+        }
+        std::string lowered = Contact::foldCase(body);
+        if (lowered == "favorite" || lowered == "fav") {
+            predicate.kind = Predicate::Favorite;
+            return true;
+        }
+
+        size_t split = body.find_first_of(":<>=");
+        if (split == std::string::npos || split == 0) {
+            error = "unknown term '" + term + "' (expected field:value, e.g. name:" + term + ")";
+            return false;
+        }
+        std::string key = Contact::foldCase(body.substr(0, split));
+        std::string op = body[split] == ':' ? "=" : body.substr(split, 1);
+        size_t valueStart = split + 1;
+        if ((op == "<" || op == ">") && valueStart < body.size() && body[valueStart] == '=') {
+            op += "=";
+            ++valueStart;
+        }
+        std::string value = body.substr(valueStart);
+
+        if (predicate.negated && key != "tag") {
+            error = "only tag: and favorite can be negated";
+            return false;
+        }
+        if (key == "created" || key == "modified" || key == "birthday") {
+            predicate.kind = key == "created" ? Predicate::Created
+                           : key == "modified" ? Predicate::Modified : Predicate::Birthday;
+            return parseDate(predicate, op, value, error);
+        }
+        if (body[split] != ':' || value.empty()) {
+            error = "'" + term + "' needs the form field:value";
+            return false;
+        }
+
+        static const struct {
+            const char* key;
+            const std::string& (Contact::*field)() const;
+        } kTextFields[] = {
+            {"name", &Contact::getFoldedName}, {"email", &Contact::getFoldedEmail},
+            {"company", &Contact::getFoldedCompany}, {"address", &Contact::getFoldedAddress},
+            {"job", &Contact::getFoldedJobTitle}, {"notes", &Contact::getFoldedNotes},
+            {"website", &Contact::getFoldedWebsite}, {"social", &Contact::getFoldedSocialMedia},
+        };
+        for (const auto& textField : kTextFields) {
+            if (key == textField.key) {
+                predicate.kind = Predicate::Text;
+                predicate.field = textField.field;
+                predicate.value = Contact::foldCase(value);
+                return true;
+            }
+        }
+        if (key == "phone") {
+            predicate.kind = Predicate::Phone;
+            predicate.value = value;
+            if (PhoneRadixTree::digitsOf(value).empty()) {
+                error = "'" + term + "' has no digits";
+                return false;
+            }
+            return true;
+        }
+        if (key == "domain") {
+            predicate.kind = Predicate::Domain;
+            predicate.value = Contact::foldCase(value);
+            return true;
+        }
+        if (key == "tag") {
+            predicate.kind = Predicate::Tag;
+            predicate.value = value;
+            return true;
+        }
+        error = "unknown field '" + key + "'";
+        return false;
+    }
+
+public:
+    // On a bad term returns false and describes it in error
+    static bool parse(const std::string& text, ContactQuery& query, std::string& error) {
+        query.predicates.clear();
+        for (const auto& term : split(text)) {
+            Predicate predicate;
+            if (!parseTerm(term, predicate, error)) return false;
+            query.predicates.push_back(predicate);
+        }
+        if (query.predicates.empty()) {
+            error = "empty query";
+            return false;
+        }
+        return true;
+    }
+
+    static bool holds(const Predicate& predicate, const Contact& contact) {
+        switch (predicate.kind) {
+            case Predicate::Text:
+                return (contact.*predicate.field)().find(predicate.value) != std::string::npos;
+            case Predicate::Phone: {
+                std::string digits = PhoneRadixTree::digitsOf(contact.getPhone());
+                std::string wanted = PhoneRadixTree::digitsOf(predicate.value);
+                bool anyStart = predicate.value.front() == '*';
+                bool anyEnd = predicate.value.back() == '*';
+                if (anyStart && anyEnd) return digits.find(wanted) != std::string::npos;
+                if (anyStart) {
+                    return digits.size() >= wanted.size() &&
+                           digits.compare(digits.size() - wanted.size(), wanted.size(), wanted) == 0;
+                }
+                if (anyEnd) return digits.compare(0, wanted.size(), wanted) == 0;
+                return digits == wanted;
+            }
+            case Predicate::Domain: {
+                if (contact.getFoldedEmail().find('@') == std::string::npos) return false;
+                std::string key = EmailDomainIndex::domainKey(contact.getFoldedEmail());
+                std::string wanted = EmailDomainIndex::domainKey(predicate.value);
+                return key == wanted || (key.size() > wanted.size() && key.compare(0, wanted.size(), wanted) == 0 &&
+                                         key[wanted.size()] == '.');
+            }
+            case Predicate::Tag: {
+                const auto& tags = contact.getTags();
+                return (std::find(tags.begin(), tags.end(), predicate.value) != tags.end()) != predicate.negated;
+            }
+            case Predicate::Favorite:
+                return contact.getIsFavorite() != predicate.negated;
+            case Predicate::Created:
+                return contact.getCreatedDate() >= predicate.from && contact.getCreatedDate() < predicate.to;
+            case Predicate::Modified:
+                return contact.getModifiedDate() >= predicate.from && contact.getModifiedDate() < predicate.to;
+            case Predicate::Birthday: {
+                const std::string& birthday = contact.getBirthday();
+                if (birthday.empty()) return false;
+                if (predicate.op == "<") return birthday < predicate.value;
+                if (predicate.op == "<=") return birthday <= predicate.value;
+                if (predicate.op == ">") return birthday > predicate.value;
+                if (predicate.op == ">=") return birthday >= predicate.value;
+                return birthday == predicate.value;
+            }
+        }
+        return false;
+    }
+
+    bool matches(const Contact& contact) const {
+        for (const auto& predicate : predicates) {
+            if (!holds(predicate, contact)) return false;
+        }
+        return true;
+    }
+};
+
+class ContactManager {
+private:
+    ContactSlotMap contacts;
+    ContactHashIndex phoneIndex; // keyed by phoneKey
+    // Contacts from older files whose phone differs from an earlier one's
+    // only in formatting. The earlier contact holds the phone key; these
+    // are reachable by id and take the key over when it is released.
+    std::vector<ContactHandle> shadowedPhones;
+    ContactHashIndex idIndex;
+    std::string filename;
+    Logger logger;
+    SimpleEncryption encryptor;
+    BackupManager backupManager;
+    BackupWorker backupWorker;
+    Statistics stats;
+    TagIndex tagIndex;
+    TrigramIndex nameTrigrams;
+    TrigramIndex emailTrigrams;
+    TrigramIndex companyTrigrams;
+    FullTextIndex fullText;
+    FuzzyNameIndex fuzzyNames;
+    PhoneticIndex phoneticNames;
+    EmailDomainIndex emailDomains;
+    BirthdayIndex birthdays;
+    PhoneRadixTree phonePrefixes;
+    PhoneRadixTree phoneSuffixes;
+    // Packed copies of the searched fields for the scan fallback, rebuilt
+    // on the first scan after any change
+    mutable PackedColumn nameColumn;
+    mutable PackedColumn emailColumn;
+    mutable PackedColumn companyColumn;
+    mutable PackedColumn phoneColumn;
+    mutable PackedColumn searchColumn;
+    mutable bool columnsStale;
+    // The upcoming birthday report, built at load and then at most once a
+    // day unless contacts or their birthdays change
+    struct BirthdayDigest {
+        int day;          // day number it was built on, -1 before the first build
+        int days;
+        uint64_t version; // of the birthday index it was built from
+        std::vector<BirthdayIndex::Upcoming> entries;
+        BirthdayDigest() : day(-1), days(0), version(0) {}
+    };
+    mutable BirthdayDigest digest;
+    bool autoBackup;
+    int autoBackupInterval;
+    std::time_t lastBackupTime;
+    StorageOptions storageOptions;
+    MutationJournal journal;
+    bool snapshotDirty; // state not captured by snapshot + journal, e.g. sort order
+    SnapshotCompactor compactor;
+    uint64_t lastReplayMicros;
+    double replayBytesPerMilli;
+    bool indexesFromSnapshot;
+    uint64_t indexMicros;
+    
+    std::string journalPath() const {
+        return filename + ".journal";
+    }
+    
+    // Journal moved aside while the compactor folds it into the snapshot
+    std::string segmentPath() const {
+        return filename + ".journal.compacting";
+    }
+    
+    static bool fileExists(const std::string& path) {
+        std::ifstream file(path);
+        return file.good();
+    }
+    
+    void startCompaction() {
+        compactor.wait();
+        // A segment left by a failed or interrupted compaction is folded
+        // first; the live journal is rotated on a later trigger
+        if (!fileExists(segmentPath()) && !journal.rotate(segmentPath())) {
+            logger.log("Could not rotate journal for compaction", "WARNING");
+            return;
+        }
+        compactor.start(filename, segmentPath(), encryptor, logger, storageOptions.compressSnapshots);
+    }
+    
+    void maybeCompact() {
+        if (compactor.isRunning() || compactor.isBackingOff()) return;
+        uint64_t bytes = journal.getByteCount();
+        bool overSize = bytes >= storageOptions.compactJournalBytes;
+        bool overReplay = replayBytesPerMilli > 0 &&
+            bytes / replayBytesPerMilli >= storageOptions.compactReplayMillis;
+        if (overSize || overReplay) {
+            startCompaction();
+        }
+    }
+    
+    static const size_t kParallelMinRecords = 16384;
+    static const int kBirthdayDigestDays = 30;
+    // Contacts resolved per page when rendering a result set
+    static const size_t kDisplayPageSize = 256;
+    
+    // Numbers of up to 15 digits, the E.164 limit, pack exactly into the
+    // key as digit count and value, so formatting and a leading + do not
+    // matter but leading zeros do. Longer numbers fall back to a hash of
+    // their digits with the top bit set.
+    static uint64_t phoneKey(const std::string& phone) {
+        uint64_t value = 0;
+        uint64_t hash = 14695981039346656037ULL;
+        unsigned digits = 0;
+        for (char c : phone) {
+            if (c < '0' || c > '9') continue;
+            if (digits < 15) value = value * 10 + static_cast<uint64_t>(c - '0');
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+            ++digits;
+        }
+        if (digits <= 15) return (static_cast<uint64_t>(digits) << 50) | value;
+        return hash | (1ULL << 63);
+    }
+    
+    static uint64_t idKey(int id) {
+        return static_cast<uint32_t>(id);
+    }
+    
+    ContactHandle phoneHandle(const std::string& phone) const {
+        uint64_t key = phoneKey(phone);
+        ContactHandle handle = phoneIndex.find(key);
+        // A hashed key could collide, so check the digits behind it
+        const Contact* contact = contacts.get(handle);
+        if (contact && (key >> 63) &&
+            PhoneRadixTree::digitsOf(contact->getPhone()) != PhoneRadixTree::digitsOf(phone)) {
+            return ContactHandle();
+        }
+        return handle;
+    }
+    
+    Contact* findByPhone(const std::string& phone) {
+        return contacts.get(phoneHandle(phone));
+    }
+    
+    const Contact* findByPhone(const std::string& phone) const {
+        return contacts.get(phoneHandle(phone));
+    }
+    
+    Contact* findById(int id) {
+        return contacts.get(idIndex.find(idKey(id)));
+    }
+    
+    const Contact* findById(int id) const {
+        return contacts.get(idIndex.find(idKey(id)));
+    }
+    
+    // Every contact in increasing id order
+    std::vector<const Contact*> contactsInIdOrder() const {
+        std::vector<const Contact*> ordered;
+        ordered.reserve(contacts.size());
+        for (const auto& contact : contacts) ordered.push_back(&contact);
+        std::sort(ordered.begin(), ordered.end(), [](const Contact* a, const Contact* b) {
+            return a->getContactId() < b->getContactId();
+        });
+        return ordered;
+    }
+    
+    void buildIndex() {
+        columnsStale = true;
+        phoneIndex.clear();
+        idIndex.clear();
+        tagIndex.clear();
+        phoneIndex.reserve(contacts.size());
+        idIndex.reserve(contacts.size());
+        
+        size_t shards = ParallelRange::shardCount(contacts.size(), kParallelMinRecords);
+        if (shards <= 1) {
+            for (size_t i = 0; i < contacts.size(); ++i) {
+                const Contact& contact = contacts[i];
+                ContactHandle handle = contacts.handleAt(i);
+                uint64_t key = phoneKey(contact.getPhone());
+                if (phoneIndex.find(key).isNull()) phoneIndex.set(key, handle);
+                idIndex.set(idKey(contact.getContactId()), handle);
+                tagIndex.addContact(handle.index, contact.getTags());
+            }
+            return;
+        }
+        
+        // The two hash indexes are each built on their own thread and the
+        // tag bitmaps on this one
+        std::thread phoneThread([this]() {
+            for (size_t i = 0; i < contacts.size(); ++i) {
+                uint64_t key = phoneKey(contacts[i].getPhone());
+                if (phoneIndex.find(key).isNull()) phoneIndex.set(key, contacts.handleAt(i));
+            }
+        });
+        std::thread idThread([this]() {
+            for (size_t i = 0; i < contacts.size(); ++i) {
+                idIndex.set(idKey(contacts[i].getContactId()), contacts.handleAt(i));
+            }
+        });
+        
+        for (size_t i = 0; i < contacts.size(); ++i) {
+            tagIndex.addContact(contacts.handleAt(i).index, contacts[i].getTags());
+        }
+        
+        phoneThread.join();
+        idThread.join();
+    }
+
+    // Text search indexes, keyed by contact id. Like the indexes above they
+    // are built once at load and then kept up to date by add, edit, delete
+    // and tag changes.
+    void indexText(const Contact& contact) {
+        columnsStale = true;
+        nameTrigrams.add(contact.getContactId(), contact.getFoldedName());
+        fuzzyNames.add(contact.getContactId(), contact.getFoldedName());
+        phoneticNames.add(contact.getContactId(), contact.getFoldedName());
+        emailTrigrams.add(contact.getContactId(), contact.getFoldedEmail());
+        emailDomains.add(contact.getContactId(), contact.getFoldedEmail());
+        birthdays.add(contact.getContactId(), contact.getBirthDate());
+        companyTrigrams.add(contact.getContactId(), contact.getFoldedCompany());
+        phonePrefixes.add(contact.getContactId(), contact.getPhone());
+        phoneSuffixes.add(contact.getContactId(), contact.getPhone());
+        fullText.add(contact);
+    }
+    
+    void unindexText(const Contact& contact) {
+        columnsStale = true;
+        nameTrigrams.remove(contact.getContactId(), contact.getFoldedName());
+        fuzzyNames.remove(contact.getContactId(), contact.getFoldedName());
+        phoneticNames.remove(contact.getContactId(), contact.getFoldedName());
+        emailTrigrams.remove(contact.getContactId(), contact.getFoldedEmail());
+        emailDomains.remove(contact.getContactId(), contact.getFoldedEmail());
+        birthdays.remove(contact.getContactId(), contact.getBirthDate());
+        companyTrigrams.remove(contact.getContactId(), contact.getFoldedCompany());
+        phonePrefixes.remove(contact.getContactId(), contact.getPhone());
+        phoneSuffixes.remove(contact.getContactId(), contact.getPhone());
+        fullText.remove(contact.getContactId());
+    }
+    
+    // Removes a live contact from the list, every index and the statistics,
+    // touching only its own entries. Journaling is left to the caller.
+    // Returns the contact's id.
+    int eraseContact(ContactHandle handle) {
+        const Contact& contact = *contacts.get(handle);
+        int contactId = contact.getContactId();
+        unindexText(contact);
+        unindexKeys(handle, contact);
+        tagIndex.removeContact(handle.index, contact.getTags());
+        stats.remove(contact);
+        contacts.erase(handle);
+        return contactId;
+    }
+    
+    // Drops a contact about to be erased from the phone and id indexes. A
+    // key another contact took over is left alone.
+    void unindexKeys(ContactHandle handle, const Contact& contact) {
+        releasePhoneKey(phoneKey(contact.getPhone()), handle);
+        if (idIndex.find(idKey(contact.getContactId())) == handle) idIndex.erase(idKey(contact.getContactId()));
+    }
+    
+    // Frees a phone key the handle holds, handing it to a shadowed contact
+    // with the same digits if there is one
+    void releasePhoneKey(uint64_t key, ContactHandle handle) {
+        auto self = std::find(shadowedPhones.begin(), shadowedPhones.end(), handle);
+        if (self != shadowedPhones.end()) shadowedPhones.erase(self);
+        if (phoneIndex.find(key) != handle) return;
+        phoneIndex.erase(key);
+        for (size_t i = 0; i < shadowedPhones.size(); ++i) {
+            const Contact* shadowed = contacts.get(shadowedPhones[i]);
+            if (!shadowed || phoneKey(shadowed->getPhone()) != key) continue;
+            phoneIndex.set(key, shadowedPhones[i]);
+            shadowedPhones.erase(shadowedPhones.begin() + i);
+            return;
+        }
+    }
+    
+    // Phones compare by digits, but files written when they compared as
+    // exact strings can hold "555-123-4567" and "5551234567" as two
+    // contacts. The one the phone index does not point to is recorded and
+    // logged rather than silently unreachable.
+    void findShadowedPhones() {
+        shadowedPhones.clear();
+        for (size_t i = 0; i < contacts.size(); ++i) {
+            ContactHandle handle = contacts.handleAt(i);
+            ContactHandle holder = phoneIndex.find(phoneKey(contacts[i].getPhone()));
+            if (holder == handle) continue;
+            shadowedPhones.push_back(handle);
+            const Contact* other = contacts.get(holder);
+            logger.log("Contact ID " + std::to_string(contacts[i].getContactId()) + " (" + contacts[i].getPhone() +
+                       ") has the same phone digits as contact ID " +
+                       (other ? std::to_string(other->getContactId()) : std::string("?")) +
+                       "; it can be found and deleted by ID only", "WARNING");
+        }
+    }
+    
+    // Text and tag removal for a batch of contacts about to be erased. Each
+    // posting list is filtered once for the whole batch, which is what
+    // keeps a large bulk delete from going quadratic; tag bitmaps drop one
+    // contact at a time cheaply. Ids must be sorted.
+    void unindexBatch(const std::vector<ContactHandle>& handles, const std::vector<int>& sortedIds) {
+        columnsStale = true;
+        std::vector<std::pair<int, const std::string*>> names, emails, companies;
+        std::vector<std::pair<int, BirthDate>> birthDates;
+        for (ContactHandle handle : handles) {
+            const Contact& contact = *contacts.get(handle);
+            names.emplace_back(contact.getContactId(), &contact.getFoldedName());
+            emails.emplace_back(contact.getContactId(), &contact.getFoldedEmail());
+            companies.emplace_back(contact.getContactId(), &contact.getFoldedCompany());
+            birthDates.emplace_back(contact.getContactId(), contact.getBirthDate());
+            phonePrefixes.remove(contact.getContactId(), contact.getPhone());
+            phoneSuffixes.remove(contact.getContactId(), contact.getPhone());
+            tagIndex.removeContact(handle.index, contact.getTags());
+        }
+        nameTrigrams.removeAll(names);
+        fuzzyNames.removeAll(names);
+        phoneticNames.removeAll(names);
+        emailTrigrams.removeAll(emails);
+        emailDomains.removeAll(emails);
+        birthdays.removeAll(birthDates);
+        companyTrigrams.removeAll(companies);
+        fullText.removeAll(sortedIds);
+    }
+    
+    void buildTextIndex() {
+        // Adding in increasing id order makes every posting list insert an
+        // append
+        const std::vector<const Contact*> byId = contactsInIdOrder();
+        auto build = [&byId](TrigramIndex& index, const std::string& (Contact::*field)() const) {
+            index.clear();
+            for (const Contact* contact : byId) {
+                index.add(contact->getContactId(), (contact->*field)());
+            }
+        };
+        auto buildFullText = [this, &byId]() {
+            fullText.clear();
+            for (const Contact* contact : byId) {
+                fullText.add(*contact);
+            }
+        };
+        auto buildFuzzy = [this, &byId]() {
+            fuzzyNames.clear();
+            phoneticNames.clear();
+            for (const Contact* contact : byId) {
+                fuzzyNames.add(contact->getContactId(), contact->getFoldedName());
+                phoneticNames.add(contact->getContactId(), contact->getFoldedName());
+            }
+        };
+        auto buildDomains = [this, &byId]() {
+            emailDomains.clear();
+            for (const Contact* contact : byId) {
+                emailDomains.add(contact->getContactId(), contact->getFoldedEmail());
+            }
+        };
+        auto buildBirthdays = [this, &byId]() {
+            birthdays.clear();
+            for (const Contact* contact : byId) {
+                birthdays.add(contact->getContactId(), contact->getBirthDate());
+            }
+        };
+        auto buildPhones = [&byId](PhoneRadixTree& tree) {
+            tree.clear();
+            for (const Contact* contact : byId) {
+                tree.add(contact->getContactId(), contact->getPhone());
+            }
+        };
+        if (contacts.size() < kParallelMinRecords) {
+            build(nameTrigrams, &Contact::getFoldedName);
+            build(emailTrigrams, &Contact::getFoldedEmail);
+            build(companyTrigrams, &Contact::getFoldedCompany);
+            buildPhones(phonePrefixes);
+            buildPhones(phoneSuffixes);
+            buildFullText();
+            buildFuzzy();
+            buildDomains();
+            buildBirthdays();
+            return;
+        }
+        std::thread emailThread([&build, this]() { build(emailTrigrams, &Contact::getFoldedEmail); });
+        std::thread companyThread([&build, this]() { build(companyTrigrams, &Contact::getFoldedCompany); });
+        std::thread fullTextThread([&buildFullText]() { buildFullText(); });
+        std::thread suffixThread([&buildPhones, this]() { buildPhones(phoneSuffixes); });
+        std::thread fuzzyThread([&buildFuzzy]() { buildFuzzy(); });
+        build(nameTrigrams, &Contact::getFoldedName);
+        buildPhones(phonePrefixes);
+        buildDomains();
+        buildBirthdays();
+        suffixThread.join();
+        fuzzyThread.join();
+        emailThread.join();
+        companyThread.join();
+        fullTextThread.join();
+    }
+    
+    void refreshColumns() const {
+        if (!columnsStale) return;
+        PackedColumn* columns[] = { &nameColumn, &emailColumn, &companyColumn, &phoneColumn, &searchColumn };
+        for (PackedColumn* column : columns) column->clear();
+        for (const auto& contact : contacts) {
+            nameColumn.buffer() += contact.getFoldedName();
+            nameColumn.endRow();
+            emailColumn.buffer() += contact.getFoldedEmail();
+            emailColumn.endRow();
+            companyColumn.buffer() += contact.getFoldedCompany();
+            companyColumn.endRow();
+            PhoneRadixTree::appendDigits(contact.getPhone(), phoneColumn.buffer());
+            phoneColumn.endRow();
+            contact.appendSearchText(searchColumn.buffer());
+            searchColumn.endRow();
+        }
+        columnsStale = false;
+    }
+    
+    // Contacts whose packed row contains the needle, in list order
+    ContactResultSet scanColumn(const PackedColumn& column, const std::string& needle) const {
+        refreshColumns();
+        std::vector<size_t> rows;
+        column.findRows(needle, rows);
+        std::vector<ContactHandle> matches;
+        matches.reserve(rows.size());
+        for (size_t row : rows) {
+            matches.push_back(contacts.handleAt(row));
+        }
+        return ContactResultSet(std::move(matches));
+    }
+    
+    // Live handles as a result set in list order
+    ContactResultSet inListOrder(std::vector<ContactHandle> handles) const {
+        contacts.sortByPosition(handles);
+        return ContactResultSet(std::move(handles));
+    }
+    
+    // Handles of the live contacts among the given ids
+    std::vector<ContactHandle> handlesByIds(const std::vector<int>& ids) const {
+        std::vector<ContactHandle> handles;
+        handles.reserve(ids.size());
+        for (int id : ids) {
+            ContactHandle handle = idIndex.find(idKey(id));
+            if (contacts.get(handle)) handles.push_back(handle);
+        }
+        return handles;
+    }
+    
+    // Contacts with the given ids, in list order
+    ContactResultSet resultsByIds(const std::vector<int>& ids) const {
+        return inListOrder(handlesByIds(ids));
+    }
+    
+    // Handles of the live contacts in the slots of a bitmap
+    std::vector<ContactHandle> handlesInSlots(const RoaringBitmap& slots) const {
+        std::vector<ContactHandle> handles;
+        handles.reserve(slots.cardinality());
+        slots.forEach([this, &handles](uint32_t slot) {
+            ContactHandle handle = contacts.handleOfSlot(slot);
+            if (!handle.isNull()) handles.push_back(handle);
+        });
+        return handles;
+    }
+    
+    // Contacts in the slots of a bitmap, in list order
+    ContactResultSet resultsInSlots(const RoaringBitmap& slots) const {
+        return inListOrder(handlesInSlots(slots));
+    }
+    
+    // A way to produce the candidates for a combined query: an index
+    // lookup serving one of its predicates, or the whole list
+    struct AccessPath {
+        std::string source;
+        size_t predicate; // served predicate, or npos for the full scan
+        size_t estimate;
+        std::function<std::vector<ContactHandle>()> fetch;
+    };
+    
+    // Every access path the indexes offer for the query, with the full
+    // scan last. Tag, domain and exact phone estimates are exact counts;
+    // trigram estimates are the shortest posting list.
+    std::vector<AccessPath> accessPaths(const ContactQuery& query) const {
+        typedef ContactQuery::Predicate Predicate;
+        std::vector<AccessPath> paths;
+        for (size_t i = 0; i < query.predicates.size(); ++i) {
+            const Predicate& predicate = query.predicates[i];
+            switch (predicate.kind) {
+                case Predicate::Text: {
+                    const TrigramIndex* index = nullptr;
+                    const char* source = nullptr;
+                    if (predicate.field == &Contact::getFoldedName) {
+                        index = &nameTrigrams;
+                        source = "name trigrams";
+                    } else if (predicate.field == &Contact::getFoldedEmail) {
+                        index = &emailTrigrams;
+                        source = "email trigrams";
+                    } else if (predicate.field == &Contact::getFoldedCompany) {
+                        index = &companyTrigrams;
+                        source = "company trigrams";
+                    }
+                    size_t estimate = index ? index->estimate(predicate.value) : SIZE_MAX;
+                    if (estimate == SIZE_MAX) break;
+                    paths.push_back(AccessPath{source, i, estimate, [this, index, &predicate]() {
+                        std::vector<int> ids;
+                        index->candidates(predicate.value, ids);
+                        return handlesByIds(ids);
+                    }});
+                    break;
+                }
+                case Predicate::Phone: {
+                    bool anyStart = predicate.value.front() == '*';
+                    bool anyEnd = predicate.value.back() == '*';
+                    if (!anyStart && !anyEnd) {
+                        ContactHandle handle = phoneHandle(predicate.value);
+                        size_t found = handle.isNull() ? 0 : 1;
+                        paths.push_back(AccessPath{"phone hash", i, found, [handle, found]() {
+                            return std::vector<ContactHandle>(found, handle);
+                        }});
+                    } else if (anyStart != anyEnd) {
+                        // The radix trees collect the ids to count them, so
+                        // the fetch hands over the same list
+                        std::vector<int> ids;
+                        (anyStart ? phoneSuffixes : phonePrefixes).find(PhoneRadixTree::digitsOf(predicate.value), ids);
+                        size_t estimate = ids.size();
+                        paths.push_back(AccessPath{anyStart ? "phone suffix tree" : "phone prefix tree", i, estimate,
+                                                   [this, ids]() { return handlesByIds(ids); }});
+                    }
+                    break;
+                }
+                case Predicate::Domain:
+                    paths.push_back(AccessPath{"email domain range", i,
+                                               static_cast<size_t>(stats.countAtDomain(predicate.value)),
+                                               [this, &predicate]() {
+                        std::vector<int> ids;
+                        emailDomains.find(predicate.value, ids);
+                        return handlesByIds(ids);
+                    }});
+                    break;
+                case Predicate::Tag: {
+                    if (predicate.negated) break;
+                    const RoaringBitmap* tagged = tagIndex.find(predicate.value);
+                    paths.push_back(AccessPath{"tag bitmap", i, tagged ? tagged->cardinality() : 0, [this, tagged]() {
+                        return tagged ? handlesInSlots(*tagged) : std::vector<ContactHandle>();
+                    }});
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+        paths.push_back(AccessPath{"full scan", std::string::npos, contacts.size(), [this]() {
+            std::vector<ContactHandle> all;
+            all.reserve(contacts.size());
+            for (size_t i = 0; i < contacts.size(); ++i) all.push_back(contacts.handleAt(i));
+            return all;
+        }});
+        return paths;
+    }
+    
+    // The path with the smallest estimate; the full scan only wins when
+    // nothing else is cheaper
+    static size_t cheapestPath(const std::vector<AccessPath>& paths) {
+        size_t chosen = paths.size() - 1;
+        for (size_t i = 0; i + 1 < paths.size(); ++i) {
+            if (paths[i].estimate < paths[chosen].estimate) chosen = i;
+        }
+        return chosen;
+    }
+    
+    // The driver's candidates that satisfy every predicate, in list order
+    ContactResultSet filterCandidates(const ContactQuery& query, const AccessPath& driver, size_t& checked) const {
+        std::vector<ContactHandle> candidates = driver.fetch();
+        checked = candidates.size();
+        std::vector<ContactHandle> matched;
+        for (ContactHandle handle : candidates) {
+            const Contact* contact = contacts.get(handle);
+            if (contact && query.matches(*contact)) matched.push_back(handle);
+        }
+        return inListOrder(std::move(matched));
+    }
+    
+    // Estimated share of contacts passing a predicate, for explain: from
+    // its access path or the statistics where there is one, otherwise a
+    // guess of one in ten. Sets known accordingly.
+    double selectivity(const ContactQuery::Predicate& predicate, const AccessPath* path, bool& known) const {
+        typedef ContactQuery::Predicate Predicate;
+        double total = std::max<size_t>(contacts.size(), 1);
+        known = true;
+        if (path) return path->estimate / total;
+        if (predicate.kind == Predicate::Favorite) {
+            double favorites = stats.getFavoritesCount() / total;
+            return predicate.negated ? 1 - favorites : favorites;
+        }
+        if (predicate.kind == Predicate::Tag) {
+            const RoaringBitmap* tagged = tagIndex.find(predicate.value);
+            return 1 - (tagged ? tagged->cardinality() : 0) / total;
+        }
+        known = false;
+        return 0.1;
+    }
+    
+    void printPlan(const ContactQuery& query, const std::vector<AccessPath>& paths, size_t chosen) const {
+        std::cout << "\n=== QUERY PLAN ===\n";
+        std::cout << std::left << std::setw(28) << "Predicate" << std::setw(22) << "Access path"
+                  << "Est. rows\n";
+        double estimate = static_cast<double>(paths[chosen].estimate);
+        double total = std::max<size_t>(contacts.size(), 1);
+        for (size_t i = 0; i < query.predicates.size(); ++i) {
+            const AccessPath* path = nullptr;
+            for (const auto& candidate : paths) {
+                if (candidate.predicate == i) path = &candidate;
+            }
+            bool known;
+            double share = selectivity(query.predicates[i], path, known);
+            if (!path || path != &paths[chosen]) estimate *= share;
+            std::cout << std::left << std::setw(28) << query.predicates[i].term
+                      << std::setw(22) << (path ? path->source : std::string("filter only"));
+            if (known) {
+                std::cout << static_cast<size_t>(share * total + 0.5);
+            } else {
+                std::cout << "? (guess " << static_cast<size_t>(share * total + 0.5) << ")";
+            }
+            std::cout << (path == &paths[chosen] ? "  <- drives" : "") << "\n";
+        }
+        const AccessPath& scan = paths.back();
+        std::cout << std::left << std::setw(28) << "(all contacts)" << std::setw(22) << scan.source
+                  << scan.estimate << (chosen + 1 == paths.size() ? "  <- drives" : "") << "\n";
+        std::cout << std::right << "Plan: read " << paths[chosen].estimate << " candidate(s) from the "
+                  << paths[chosen].source << ", check the other predicates on each\n";
+        std::cout << "Estimated result: " << static_cast<size_t>(estimate + 0.5) << " contact(s)\n";
+    }
+    
+    // Contacts whose folded field contains the query, ignoring case, in list
+    // order. Queries shorter than a trigram fall back to scanning the packed
+    // column of that field.
+    ContactResultSet findByText(const TrigramIndex& index, const std::string& (Contact::*field)() const,
+                                const PackedColumn& column, const std::string& query) const {
+        std::string folded = Contact::foldCase(query);
+        std::vector<int> candidateIds;
+        if (!index.candidates(folded, candidateIds)) {
+            return scanColumn(column, folded);
+        }
+        std::vector<ContactHandle> matches;
+        for (int id : candidateIds) {
+            ContactHandle handle = idIndex.find(idKey(id));
+            const Contact* contact = contacts.get(handle);
+            if (contact && (contact->*field)().find(folded) != std::string::npos) {
+                matches.push_back(handle);
+            }
+        }
+        return inListOrder(std::move(matches));
+    }
+
+    // Writes a full snapshot and empties the journal it now covers
+    void saveToFile() {
+        compactor.wait();
+        if (!SnapshotFile::write(filename, contacts, encryptor, journal.lastSequence(),
+                                 storageOptions.compressSnapshots)) {
+            std::cerr << "Error: Could not save contacts to file!\n";
+            logger.log("Failed to save contacts to file: " + filename, "ERROR");
+            return;
+        }
+        journal.reset();
+        std::remove(segmentPath().c_str());
+        snapshotDirty = false;
+        
+        logger.log("Contacts saved successfully: " + std::to_string(contacts.size()) + " contacts", "INFO");
+    }
+
+    // Fills the indexes using the id ordering and tag lists saved in the
+    // snapshot. The phone and id tables are hash tables, so they cost the
+    // same here as in buildIndex; the saving is in the tag bitmaps. The id
+    // ordering is checked to be strictly increasing, which confirms it
+    // covers the loaded contacts. Returns false if it does not.
+    bool adoptIndexes(const SnapshotFile::Indexes& saved) {
+        phoneIndex.clear();
+        idIndex.clear();
+        tagIndex.clear();
+        phoneIndex.reserve(contacts.size());
+        idIndex.reserve(saved.byId.size());
+        
+        // As in buildIndex, the first contact in list order holds a phone
+        // key that differently formatted phones share
+        for (size_t i = 0; i < contacts.size(); ++i) {
+            uint64_t key = phoneKey(contacts[i].getPhone());
+            if (phoneIndex.find(key).isNull()) phoneIndex.set(key, contacts.handleAt(i));
+        }
+        // Ordinals are positions in the freshly loaded list
+        const Contact* previous = nullptr;
+        for (uint32_t ordinal : saved.byId) {
+            const Contact* contact = &contacts[ordinal];
+            if (previous && !(previous->getContactId() < contact->getContactId())) return false;
+            idIndex.set(idKey(contact->getContactId()), contacts.handleAt(ordinal));
+            previous = contact;
+        }
+        for (size_t i = 0; i < contacts.size(); ++i) {
+            tagIndex.addContact(contacts.handleAt(i).index, std::vector<std::string>());
+        }
+        for (const auto& entry : saved.tags) {
+            for (uint32_t ordinal : entry.second) {
+                tagIndex.addTag(contacts.handleAt(ordinal).index, entry.first);
+            }
+        }
+        return true;
+    }
+    
+    bool loadSnapshot(const MappedFile& mapped, std::vector<Contact>& loaded, uint64_t& journalSequence,
+                      SnapshotFile::Indexes& indexes, bool& haveIndexes) {
+        SnapshotFile::Header header;
+        if (!SnapshotFile::readHeader(mapped.begin(), mapped.size(), header)) {
+            return false;
+        }
+        journalSequence = header.journalSequence;
+        haveIndexes = SnapshotFile::readIndexes(mapped.begin(), mapped.size(), header, encryptor, indexes);
+        
+        // The offset table gives every record (or block) boundary up front,
+        // so shards decode into their own vectors in parallel
+        size_t partCount = SnapshotFile::partCount(header);
+        size_t shards = std::min(ParallelRange::shardCount(header.recordCount, kParallelMinRecords),
+                                 std::max<size_t>(1, partCount));
+        std::vector<std::vector<Contact>> parts(shards);
+        std::vector<char> decoded(shards, 0);
+        const SimpleEncryption& crypt = encryptor;
+        ParallelRange::run(partCount, shards,
+            [&mapped, &header, &crypt, &parts, &decoded](size_t shard, size_t begin, size_t end) {
+                if (!(header.flags & SnapshotFile::kFlagCompressed)) parts[shard].reserve(end - begin);
+                decoded[shard] = SnapshotFile::readParts(mapped.begin(), header, begin, end, crypt, parts[shard]);
+            });
+        if (std::find(decoded.begin(), decoded.end(), 0) != decoded.end()) {
+            return false;
+        }
+        ParallelRange::concat(parts, loaded);
+        if (loaded.size() != header.recordCount) {
+            loaded.clear();
+            return false;
+        }
+        for (const auto& contact : loaded) {
+            ContactCodec::reserveId(contact.getContactId());
+        }
+        return true;
+    }
+    
+    void loadLegacyText(const MappedFile& mapped, std::vector<Contact>& loaded) {
+        // Decrypt the whole file once; the key stream depends only on the
+        // byte offset, so large files are decrypted in parallel slices
+        std::vector<char> text(mapped.begin(), mapped.begin() + mapped.size());
+        const SimpleEncryption& crypt = encryptor;
+        size_t sliceSize = SimpleEncryption::kBlockSize;
+        size_t slices = (text.size() + sliceSize - 1) / sliceSize;
+        ParallelRange::run(slices, ParallelRange::shardCount(slices, 64),
+            [&text, &crypt, sliceSize](size_t, size_t begin, size_t end) {
+                size_t from = begin * sliceSize;
+                size_t to = std::min(text.size(), end * sliceSize);
+                crypt.applyInPlace(text.data() + from, to - from, from);
+            });
+        
+        const char* data = text.data();
+        const char* dataEnd = data + text.size();
+        std::vector<const char*> starts(1, data);
+        const char* cursor = data;
+        while (cursor < dataEnd && TextRecordParser::skip(cursor, dataEnd)) {
+            starts.push_back(cursor);
+        }
+        size_t recordCount = starts.size() - 1;
+        
+        size_t shards = ParallelRange::shardCount(recordCount, kParallelMinRecords);
+        std::vector<std::vector<Contact>> parts(shards);
+        ParallelRange::run(recordCount, shards,
+            [&starts, &parts](size_t shard, size_t begin, size_t end) {
+                std::vector<Contact>& out = parts[shard];
+                out.reserve(end - begin);
+                const char* p = starts[begin];
+                for (size_t i = begin; i < end; ++i) {
+                    out.push_back(ContactCodec::makeEmpty(0));
+                    if (!TextRecordParser::parse(p, starts[end], out.back())) {
+                        out.pop_back();
+                        break;
+                    }
+                }
+            });
+        ParallelRange::concat(parts, loaded);
+        snapshotDirty = true;
+        logger.log("Migrating text contact file to binary snapshot format", "INFO");
+    }
+
+    void loadFromFile() {
+        std::vector<Contact> loaded;
+        uint64_t journalSequence = 0;
+        SnapshotFile::Indexes savedIndexes;
+        bool haveIndexes = false;
+        MappedFile mapped;
+        if (!mapped.open(filename)) {
+            logger.log("No existing contact file found, starting fresh", "INFO");
+        } else if (SnapshotFile::isSnapshot(mapped.begin(), mapped.size())) {
+            if (!loadSnapshot(mapped, loaded, journalSequence, savedIndexes, haveIndexes)) {
+                haveIndexes = false;
+                mapped.close();
+                // Keep the unreadable files for recovery instead of overwriting them
+                std::rename(filename.c_str(), (filename + ".corrupt").c_str());
+                std::rename(journalPath().c_str(), (journalPath() + ".corrupt").c_str());
+                logger.log("Contact snapshot is corrupt or from an unsupported version, moved to " +
+                           filename + ".corrupt", "ERROR");
+            }
+        } else {
+            loadLegacyText(mapped, loaded);
+        }
+        mapped.close();
+        
+        auto replayStart = std::chrono::steady_clock::now();
+        bool pendingSegment = fileExists(segmentPath());
+        size_t replayed = 0;
+        uint64_t replayedBytes = 0;
+        if (pendingSegment) {
+            replayed += journal.replay(segmentPath(), encryptor, journalSequence, loaded);
+            replayedBytes += journal.getByteCount();
+        }
+        replayed += journal.replay(journalPath(), encryptor, journalSequence, loaded);
+        replayedBytes += journal.getByteCount();
+        contacts.assign(std::move(loaded));
+        lastReplayMicros = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - replayStart).count());
+        if (replayedBytes >= 1024 * 1024 && lastReplayMicros > 0) {
+            replayBytesPerMilli = replayedBytes * 1000.0 / lastReplayMicros;
+        }
+        if (replayed > 0) {
+            logger.log("Replayed " + std::to_string(replayed) + " journaled changes", "INFO");
+        }
+        if (!journal.open(journalPath(), encryptor, storageOptions)) {
+            logger.log("Could not open journal " + journalPath() + ", changes are kept until exit", "WARNING");
+        }
+        
+        if (snapshotDirty) {
+            saveToFile();
+        } else if (pendingSegment ||
+                   lastReplayMicros / 1000 >= static_cast<uint64_t>(storageOptions.compactReplayMillis)) {
+            startCompaction();
+        }
+        
+        // Saved indexes describe the snapshot alone, so any replayed change
+        // means rebuilding them
+        auto indexStart = std::chrono::steady_clock::now();
+        indexesFromSnapshot = haveIndexes && replayed == 0 && adoptIndexes(savedIndexes);
+        if (!indexesFromSnapshot) {
+            buildIndex();
+        }
+        findShadowedPhones();
+        buildTextIndex();
+        indexMicros = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - indexStart).count());
+        stats.update(contacts);
+        logger.log("Loaded " + std::to_string(contacts.size()) + " contacts from file, indexes " +
+                   (indexesFromSnapshot ? "loaded from snapshot" : "rebuilt"), "INFO");
+    }
+
+    static void printCompactHeader() {
+        std::cout << "\n" << std::setw(4) << "ID" << " | "
+                  << std::setw(20) << std::left << "Name" << " | "
+                  << std::setw(15) << "Phone" << " | "
+                  << std::setw(20) << "Email" << " | "
+                  << "Fav" << std::endl;
+        std::cout << std::string(70, '-') << std::endl;
+    }
+
+    template <typename ContactList>
+    void displayContacts(const ContactList& contactList, bool compact = false) const {
+        if (compact) {
+            printCompactHeader();
             for (size_t i = 0; i < contactList.size(); ++i) {
                 contactList[i].displayCompact();
             }
@@ -544,13 +6037,59 @@ private:
         }
     }
 
+    // Renders search results a page at a time, so a broad search holds one
+    // page of contact pointers rather than copies of every match
+    void displayContacts(const ContactResultSet& results, bool compact = false) const {
+        if (compact) {
+            printCompactHeader();
+        } else {
+            std::cout << "\n=== CONTACTS (" << results.size() << ") ===\n";
+        }
+        ContactResultSet::Page page;
+        std::string token;
+        size_t shown = 0;
+        do {
+            results.read(contacts, kDisplayPageSize, token, page);
+            for (const Contact* contact : page.contacts) {
+                if (compact) {
+                    contact->displayCompact();
+                } else {
+                    std::cout << "Contact #" << ++shown << ":\n";
+                    contact->display();
+                }
+            }
+            token = page.nextToken;
+        } while (!token.empty());
+    }
+
+    // Queues a backup of the data file. Pending journal records are first
+    // folded into a new snapshot by the compactor; the worker waits for it,
+    // so the backup copies a complete snapshot file, never a half-written one.
+    // Auto-backups accept the snapshot of a compaction already in progress
+    // and respect the backoff after a failed one; upToDate waits for it and
+    // compacts again regardless, so nothing is left out.
+    uint64_t requestBackup(bool upToDate) {
+        if (upToDate) compactor.wait();
+        bool mayCompact = upToDate || !compactor.isBackingOff();
+        if (mayCompact && !compactor.isRunning() &&
+            (journal.getRecordCount() > 0 || fileExists(segmentPath()))) {
+            startCompaction();
+        }
+        SnapshotCompactor* pendingCompaction = &compactor;
+        return backupWorker.enqueue(filename, [pendingCompaction]() {
+            pendingCompaction->waitUntilIdle();
+        });
+    }
+
     void checkAutoBackup() {
         if (autoBackup) {
             auto now = std::time(nullptr);
             if (std::difftime(now, lastBackupTime) >= autoBackupInterval) {
-                if (backupManager.createBackup(filename)) {
-                    logger.log("Auto-backup created successfully", "INFO");
+                if (requestBackup(false) != 0) {
                     lastBackupTime = now;
+                } else {
+                    logger.log("Auto-backup deferred: backup queue is full", "WARNING");
+                    lastBackupTime = now - autoBackupInterval + 60; // retry in a minute
                 }
             }
         }
@@ -558,16 +6097,28 @@ private:
 
 public:
     ContactManager(const std::string& filename = "contacts.dat", 
-                   bool enableAutoBackup = true, int backupInterval = 3600) 
-        : filename(filename), logger(), encryptor(), backupManager(),
-          autoBackup(enableAutoBackup), autoBackupInterval(backupInterval),
-          lastBackupTime(std::time(nullptr)) {
+                   bool enableAutoBackup = true, int backupInterval = 3600,
+                   const StorageOptions& storage = StorageOptions()) 
+        : filename(filename), logger(), encryptor(), backupManager(), backupWorker(backupManager, logger),
+          phonePrefixes(false), phoneSuffixes(true), columnsStale(true), autoBackup(enableAutoBackup), autoBackupInterval(backupInterval),
+          lastBackupTime(std::time(nullptr)), storageOptions(storage),
+          snapshotDirty(false), lastReplayMicros(0), replayBytesPerMilli(0),
+          indexesFromSnapshot(false), indexMicros(0) {
         loadFromFile();
+        birthdayDigest(kBirthdayDigestDays);
         std::cout << "Loaded " << contacts.size() << " contacts.\n";
     }
 
+    // Journaled changes are already durable and are replayed or compacted
+    // on the next start, so exit only rewrites the snapshot for state the
+    // journal does not hold: a new sort order, or appends that failed.
     ~ContactManager() {
-        saveToFile();
+        backupWorker.stop();
+        compactor.wait();
+        if (snapshotDirty || journal.hasLostRecords()) {
+            saveToFile();
+        }
+        journal.close();
         std::cout << "Saved " << contacts.size() << " contacts.\n";
     }
 
@@ -598,16 +6149,16 @@ public:
             return false;
         }
         
-        contacts.push_back(contact);
-        phoneIndex[contact.getPhone()] = &contacts.back();
-        idIndex[contact.getContactId()] = &contacts.back();
+        ContactHandle handle = contacts.insert(contact);
+        journal.appendContact(MutationJournal::AddContact, contact);
+        maybeCompact();
+        phoneIndex.set(phoneKey(contact.getPhone()), handle);
+        idIndex.set(idKey(contact.getContactId()), handle);
         
-        // Update tag index
-        for (const auto& tag : contact.getTags()) {
-            tagIndex[tag].push_back(&contacts.back());
-        }
+        tagIndex.addContact(handle.index, contact.getTags());
+        indexText(contact);
         
-        stats.update(contacts);
+        stats.add(contact);
         logger.log("Contact added: " + contact.getName() + " (" + contact.getPhone() + ")", "INFO");
         std::cout << "Contact added successfully! (ID: " << contact.getContactId() << ")\n";
         
@@ -617,46 +6168,108 @@ public:
 
     // Multiple deletion options
     bool deleteContact(const std::string& phone) {
-        auto it = phoneIndex.find(phone);
-        if (it == phoneIndex.end()) {
+        ContactHandle handle = phoneHandle(phone);
+        if (!contacts.get(handle)) {
             std::cout << "Contact with phone number " << phone << " not found!\n";
             return false;
         }
-        
-        logger.log("Contact deleted: " + it->second->getName() + " (" + phone + ")", "INFO");
-        int contactId = it->second->getContactId();
-        
-        contacts.erase(std::remove_if(contacts.begin(), contacts.end(),
-            [&](const Contact& c) { return c.getPhone() == phone; }), contacts.end());
-        
-        phoneIndex.erase(phone);
-        idIndex.erase(contactId);
-        buildIndex(); // Rebuild tag index
-        stats.update(contacts);
+        return deleteHandle(handle);
+    }
+    
+    bool deleteContactById(int id) {
+        ContactHandle handle = idIndex.find(idKey(id));
+        if (!contacts.get(handle)) {
+            std::cout << "Contact with ID " << id << " not found!\n";
+            return false;
+        }
+        return deleteHandle(handle);
+    }
+    
+private:
+    bool deleteHandle(ContactHandle handle) {
+        Contact* target = contacts.get(handle);
+        logger.log("Contact deleted: " + target->getName() + " (" + target->getPhone() + ")", "INFO");
+        int contactId = eraseContact(handle);
+        journal.appendDelete(contactId);
+        maybeCompact();
         
         std::cout << "Contact deleted successfully!\n";
         checkAutoBackup();
         return true;
     }
     
-    bool deleteContactById(int id) {
-        auto it = idIndex.find(id);
-        if (it == idIndex.end()) {
-            std::cout << "Contact with ID " << id << " not found!\n";
-            return false;
+public:
+    // Deletes every listed contact that exists, journaling the batch with a
+    // single sync and checking compaction and backups once. Returns the
+    // number deleted.
+    size_t deleteContacts(const std::vector<int>& ids) {
+        std::vector<int> deleted(ids);
+        std::sort(deleted.begin(), deleted.end());
+        deleted.erase(std::unique(deleted.begin(), deleted.end()), deleted.end());
+        std::vector<ContactHandle> handles;
+        size_t kept = 0;
+        for (int id : deleted) {
+            ContactHandle handle = idIndex.find(idKey(id));
+            if (!contacts.get(handle)) continue;
+            handles.push_back(handle);
+            deleted[kept++] = id;
+        }
+        deleted.resize(kept);
+        if (deleted.empty()) {
+            std::cout << "None of the given contacts were found.\n";
+            return 0;
+        }
+        
+        unindexBatch(handles, deleted);
+        for (ContactHandle handle : handles) {
+            const Contact& contact = *contacts.get(handle);
+            unindexKeys(handle, contact);
+            stats.remove(contact);
+            contacts.erase(handle);
         }
-        return deleteContact(it->second->getPhone());
+        journal.appendDeletes(deleted);
+        maybeCompact();
+        
+        logger.log("Bulk delete: " + std::to_string(deleted.size()) + " of " +
+                   std::to_string(ids.size()) + " contacts deleted", "INFO");
+        std::cout << deleted.size() << " contact(s) deleted";
+        if (deleted.size() < ids.size()) std::cout << ", " << ids.size() - deleted.size() << " not found";
+        std::cout << ".\n";
+        checkAutoBackup();
+        return deleted.size();
     }
-
+    
     // Advanced editing with partial updates
     bool editContact(const std::string& phone) {
-        auto it = phoneIndex.find(phone);
-        if (it == phoneIndex.end()) {
+        ContactHandle handle = phoneHandle(phone);
+        Contact* found = contacts.get(handle);
+        if (!found) {
             std::cout << "Contact with phone number " << phone << " not found!\n";
             return false;
         }
 
-        Contact& contact = *(it->second);
+        Contact& contact = *found;
+        unindexText(contact);
+        stats.remove(contact);
+        bool updated = promptForEdits(handle, contact);
+        stats.add(contact);
+        indexText(contact);
+        // Fields accepted before a validation error stay applied, so the
+        // record is journaled either way
+        journal.appendContact(MutationJournal::UpdateContact, contact);
+        maybeCompact();
+        if (!updated) {
+            return false;
+        }
+
+        logger.log("Contact updated: " + contact.getName() + " (" + contact.getPhone() + ")", "INFO");
+        std::cout << "Contact updated successfully!\n";
+        checkAutoBackup();
+        return true;
+    }
+
+private:
+    bool promptForEdits(ContactHandle handle, Contact& contact) {
         std::string input;
 
         std::cout << "Editing contact: " << contact.getName() << std::endl;
@@ -681,13 +6294,17 @@ public:
                 std::cout << "Error: Invalid phone format!\n";
                 return false;
             }
-            if (phoneExists(input) && input != phone) {
+            ContactHandle holder = phoneHandle(input);
+            if (!holder.isNull() && holder != handle) {
                 std::cout << "Error: Phone number already exists!\n";
                 return false;
             }
-            phoneIndex.erase(phone);
+            // Reformatting the same digits keeps the key
+            if (phoneKey(input) != phoneKey(contact.getPhone())) {
+                releasePhoneKey(phoneKey(contact.getPhone()), handle);
+                phoneIndex.set(phoneKey(input), handle);
+            }
             contact.setPhone(input);
-            phoneIndex[input] = &contact;
         }
 
         // Email
@@ -741,14 +6358,11 @@ public:
         if (!input.empty() && (input[0] == 'y' || input[0] == 'Y')) {
             contact.setIsFavorite(!contact.getIsFavorite());
         }
-
-        buildIndex(); // Rebuild indexes
-        logger.log("Contact updated: " + contact.getName() + " (" + contact.getPhone() + ")", "INFO");
-        std::cout << "Contact updated successfully!\n";
-        checkAutoBackup();
         return true;
     }
 
+public:
+
     // Multiple display options
     void displayAllContacts(bool compact = false) const {
         if (contacts.empty()) {
@@ -758,11 +6372,83 @@ public:
         displayContacts(contacts, compact);
     }
 
+    // Search results as handles, to be read a page at a time through
+    // readPage. The select functions match the search functions below
+    // without printing anything.
+    ContactResultSet selectFavorites() const {
+        std::vector<ContactHandle> favorites;
+        for (size_t i = 0; i < contacts.size(); ++i) {
+            if (contacts[i].getIsFavorite()) favorites.push_back(contacts.handleAt(i));
+        }
+        return ContactResultSet(std::move(favorites));
+    }
+
+    // The most recently modified contacts, newest first
+    ContactResultSet selectRecent(size_t count) const {
+        std::vector<ContactHandle> recent;
+        recent.reserve(contacts.size());
+        for (size_t i = 0; i < contacts.size(); ++i) recent.push_back(contacts.handleAt(i));
+        count = std::min(count, recent.size());
+        std::partial_sort(recent.begin(), recent.begin() + count, recent.end(),
+                          [this](ContactHandle a, ContactHandle b) {
+                              return contacts.get(a)->getModifiedDate() > contacts.get(b)->getModifiedDate();
+                          });
+        recent.resize(count);
+        return ContactResultSet(std::move(recent));
+    }
+
+    ContactResultSet selectByName(const std::string& name) const {
+        return findByText(nameTrigrams, &Contact::getFoldedName, nameColumn, name);
+    }
+
+    // "@acme.com" selects the domain and its subdomains, anything else
+    // is a substring
+    ContactResultSet selectByEmail(const std::string& email) const {
+        if (email.size() > 1 && email.front() == '@') {
+            std::vector<int> ids;
+            emailDomains.find(Contact::foldCase(email), ids);
+            return resultsByIds(ids);
+        }
+        return findByText(emailTrigrams, &Contact::getFoldedEmail, emailColumn, email);
+    }
+
+    ContactResultSet selectByCompany(const std::string& company) const {
+        return findByText(companyTrigrams, &Contact::getFoldedCompany, companyColumn, company);
+    }
+
+    ContactResultSet selectByTag(const std::string& tag) const {
+        const RoaringBitmap* tagged = tagIndex.find(tag);
+        return tagged ? resultsInSlots(*tagged) : ContactResultSet();
+    }
+
+    // False with the reason in error for an expression that does not parse
+    bool selectByTags(const std::string& expression, ContactResultSet& results, std::string& error) const {
+        RoaringBitmap matched;
+        if (!tagIndex.query(expression, matched, error)) return false;
+        results = resultsInSlots(matched);
+        return true;
+    }
+
+    // False with the reason in error for a query that does not parse
+    bool selectByQuery(const std::string& text, ContactResultSet& results, std::string& error) const {
+        ContactQuery query;
+        if (!ContactQuery::parse(text, query, error)) return false;
+        std::vector<AccessPath> paths = accessPaths(query);
+        size_t checked;
+        results = filterCandidates(query, paths[cheapestPath(paths)], checked);
+        return true;
+    }
+
+    // Up to pageSize contacts of a result set, from the start for an
+    // empty token, else from the nextToken of the previous page. False
+    // for a token from another result set.
+    bool readPage(const ContactResultSet& results, size_t pageSize, const std::string& token,
+                  ContactResultSet::Page& page) const {
+        return results.read(contacts, pageSize, token, page);
+    }
+
     void displayFavorites(bool compact = false) const {
-        std::vector<Contact> favorites;
-        std::copy_if(contacts.begin(), contacts.end(), std::back_inserter(favorites),
-                    [](const Contact& c) { return c.getIsFavorite(); });
-        
+        ContactResultSet favorites = selectFavorites();
         if (favorites.empty()) {
             std::cout << "No favorite contacts found.\n";
             return;
@@ -771,30 +6457,12 @@ public:
     }
 
     void displayRecent(int count = 10, bool compact = true) const {
-        std::vector<Contact> recentContacts = contacts;
-        std::sort(recentContacts.begin(), recentContacts.end(),
-                 [](const Contact& a, const Contact& b) {
-                     return a.getModifiedDate() > b.getModifiedDate();
-                 });
-        
-        if (count < recentContacts.size()) {
-            recentContacts.resize(count);
-        }
-        
-        displayContacts(recentContacts, compact);
+        displayContacts(selectRecent(static_cast<size_t>(std::max(count, 0))), compact);
     }
 
     // Advanced search with multiple criteria
     void searchByName(const std::string& name) const {
-        std::vector<Contact> results;
-        std::copy_if(contacts.begin(), contacts.end(), std::back_inserter(results),
-                    [&](const Contact& c) { 
-                        std::string contactName = c.getName();
-                        std::string searchName = name;
-                        std::transform(contactName.begin(), contactName.end(), contactName.begin(), ::tolower);
-                        std::transform(searchName.begin(), searchName.end(), searchName.begin(), ::tolower);
-                        return contactName.find(searchName) != std::string::npos;
-                    });
+        ContactResultSet results = selectByName(name);
 
         if (results.empty()) {
             std::cout << "No contacts found with name containing: " << name << std::endl;
@@ -804,18 +6472,69 @@ public:
         }
     }
 
+    // Names within a few typos of the query, closest first. Every word of
+    // the query has to be within maxTypos edits of a word of the name.
+    void searchByNameFuzzy(const std::string& name, int maxTypos = 2, size_t limit = 20) const {
+        std::vector<FuzzyNameIndex::Match> matches;
+        fuzzyNames.search(name, maxTypos, matches);
+        std::vector<int> ids;
+        ids.reserve(matches.size());
+        for (const auto& match : matches) ids.push_back(match.contactId);
+        ContactResultSet results(handlesByIds(ids));
+        results.truncate(limit);
+
+        if (results.empty()) {
+            std::cout << "No contacts found with a name close to: " << name << std::endl;
+        } else {
+            std::cout << "Closest " << results.size() << " of " << matches.size()
+                      << " match(es), fewest typos first:\n";
+            displayContacts(results, true);
+        }
+    }
+
+    // Names that sound like the query, in list order: "Jon Smyth" finds
+    // John Smith
+    void searchByNameSoundsLike(const std::string& name) const {
+        std::vector<int> ids;
+        phoneticNames.search(name, ids, [this](int id) {
+            const Contact* contact = findById(id);
+            return contact ? &contact->getFoldedName() : nullptr;
+        });
+        ContactResultSet results = resultsByIds(ids);
+
+        if (results.empty()) {
+            std::cout << "No contacts found with a name sounding like: " << name << std::endl;
+        } else {
+            std::cout << "Found " << results.size() << " contact(s):\n";
+            displayContacts(results, true);
+        }
+    }
+
+    // Exact number, or with formatting ignored: "555*" for numbers starting
+    // with 555, "*1234" for numbers ending in 1234, and any other digits
+    // for numbers containing them
     void searchByPhone(const std::string& phone) const {
-        auto it = phoneIndex.find(phone);
-        if (it != phoneIndex.end()) {
+        bool wildcard = !phone.empty() && (phone.front() == '*' || phone.back() == '*');
+        const Contact* exact = wildcard ? nullptr : findByPhone(phone);
+        if (exact) {
             std::cout << "Contact found:\n";
-            it->second->display();
+            exact->display();
         } else {
-            // Partial phone search
-            std::vector<Contact> results;
-            std::copy_if(contacts.begin(), contacts.end(), std::back_inserter(results),
-                        [&](const Contact& c) { 
-                            return c.getPhone().find(phone) != std::string::npos;
-                        });
+            std::string digits = PhoneRadixTree::digitsOf(phone);
+            ContactResultSet results;
+            if (!digits.empty()) {
+                std::vector<int> ids;
+                if (phone.front() == '*') {
+                    phoneSuffixes.find(digits, ids);
+                    results = resultsByIds(ids);
+                } else if (phone.back() == '*') {
+                    phonePrefixes.find(digits, ids);
+                    results = resultsByIds(ids);
+                } else {
+                    // Partial phone search
+                    results = scanColumn(phoneColumn, digits);
+                }
+            }
             
             if (results.empty()) {
                 std::cout << "No contact found with phone: " << phone << std::endl;
@@ -826,17 +6545,19 @@ public:
         }
     }
 
+    // "@acme.com" finds everyone at acme.com and its subdomains through
+    // the domain index; anything else is a substring search
     void searchByEmail(const std::string& email) const {
-        std::vector<Contact> results;
-        std::string searchEmail = email;
-        std::transform(searchEmail.begin(), searchEmail.end(), searchEmail.begin(), ::tolower);
-
-        for (const auto& contact : contacts) {
-            std::string contactEmail = contact.getEmail();
-            std::transform(contactEmail.begin(), contactEmail.end(), contactEmail.begin(), ::tolower);
-            if (contactEmail.find(searchEmail) != std::string::npos) {
-                results.push_back(contact);
+        ContactResultSet results = selectByEmail(email);
+        if (email.size() > 1 && email.front() == '@') {
+            if (results.empty()) {
+                std::cout << "No contacts found at domain: " << email.substr(1) << std::endl;
+            } else {
+                std::cout << "Found " << stats.countAtDomain(email.substr(1)) << " contact(s) at "
+                          << email.substr(1) << " and its subdomains:\n";
+                displayContacts(results, true);
             }
+            return;
         }
 
         if (results.empty()) {
@@ -848,17 +6569,7 @@ public:
     }
 
     void searchByCompany(const std::string& company) const {
-        std::vector<Contact> results;
-        std::string searchCompany = company;
-        std::transform(searchCompany.begin(), searchCompany.end(), searchCompany.begin(), ::tolower);
-
-        for (const auto& contact : contacts) {
-            std::string contactCompany = contact.getCompany();
-            std::transform(contactCompany.begin(), contactCompany.end(), contactCompany.begin(), ::tolower);
-            if (contactCompany.find(searchCompany) != std::string::npos) {
-                results.push_back(contact);
-            }
-        }
+        ContactResultSet results = selectByCompany(company);
 
         if (results.empty()) {
             std::cout << "No contacts found with company containing: " << company << std::endl;
@@ -869,12 +6580,8 @@ public:
     }
 
     void searchByTag(const std::string& tag) const {
-        auto it = tagIndex.find(tag);
-        if (it != tagIndex.end()) {
-            std::vector<Contact> results;
-            for (const auto& contactPtr : it->second) {
-                results.push_back(*contactPtr);
-            }
+        ContactResultSet results = selectByTag(tag);
+        if (!results.empty()) {
             std::cout << "Found " << results.size() << " contact(s) with tag '" << tag << "':\n";
             displayContacts(results, true);
         } else {
@@ -882,10 +6589,73 @@ public:
         }
     }
 
-    void globalSearch(const std::string& query) const {
-        std::vector<Contact> results;
-        std::copy_if(contacts.begin(), contacts.end(), std::back_inserter(results),
-                    [&](const Contact& c) { return c.matchesSearch(query); });
+    // Contacts matching a boolean tag expression such as
+    // "vip AND emea AND NOT churned", in list order. AND binds tighter
+    // than OR, parentheses group and a tag with spaces goes in quotes.
+    void searchByTags(const std::string& expression) const {
+        ContactResultSet results;
+        std::string error;
+        if (!selectByTags(expression, results, error)) {
+            std::cout << "Invalid tag query: " << error << std::endl;
+            return;
+        }
+        if (results.empty()) {
+            std::cout << "No contacts match: " << expression << std::endl;
+        } else {
+            std::cout << "Found " << results.size() << " contact(s):\n";
+            displayContacts(results, true);
+        }
+    }
+
+    // Combined search over any fields, tags, favorites and dates (see
+    // ContactQuery for the syntax). The planner drives from whichever
+    // index promises the fewest candidates and checks every predicate on
+    // each of them; with explain set it prints the plan and its estimates
+    // first.
+    void runQuery(const std::string& text, bool explain = false) const {
+        ContactQuery query;
+        std::string error;
+        if (!ContactQuery::parse(text, query, error)) {
+            std::cout << "Invalid query: " << error << std::endl;
+            return;
+        }
+        std::vector<AccessPath> paths = accessPaths(query);
+        size_t chosen = cheapestPath(paths);
+        if (explain) printPlan(query, paths, chosen);
+        
+        auto start = std::chrono::steady_clock::now();
+        size_t checked;
+        ContactResultSet results = filterCandidates(query, paths[chosen], checked);
+        if (explain) {
+            double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Actual: checked " << checked << " candidate(s), " << results.size()
+                      << " matched in " << millis << " ms\n\n";
+        }
+        
+        if (results.empty()) {
+            std::cout << "No contacts match: " << text << std::endl;
+        } else {
+            std::cout << "Found " << results.size() << " contact(s):\n";
+            displayContacts(results, true);
+        }
+    }
+
+    // Ranked word search across all fields and tags, showing the best
+    // `limit` matches. Text that matches no whole word, such as part of a
+    // name, falls back to the substring scan.
+    void globalSearch(const std::string& query, size_t limit = 20) const {
+        std::vector<int> ids;
+        for (const auto& hit : fullText.search(query, limit)) {
+            ids.push_back(hit.contactId);
+        }
+        ContactResultSet results(handlesByIds(ids));
+        if (!results.empty()) {
+            std::cout << "Top " << results.size() << " match(es), best first:\n";
+            displayContacts(results, true);
+            return;
+        }
+        
+        results = scanColumn(searchColumn, Contact::foldCase(query));
 
         if (results.empty()) {
             std::cout << "No contacts found matching: " << query << std::endl;
@@ -897,66 +6667,74 @@ public:
 
     // Advanced sorting
     void sortByName() {
-        std::sort(contacts.begin(), contacts.end());
-        buildIndex();
+        contacts.sort([](const Contact& a, const Contact& b) { return a < b; });
+        columnsStale = true;
+        snapshotDirty = true;
         std::cout << "Contacts sorted by name.\n";
     }
 
     void sortByPhone() {
-        std::sort(contacts.begin(), contacts.end(), 
-            [](const Contact& a, const Contact& b) {
-                return a.getPhone() < b.getPhone();
-            });
-        buildIndex();
+        contacts.sort([](const Contact& a, const Contact& b) {
+            return a.getPhone() < b.getPhone();
+        });
+        columnsStale = true;
+        snapshotDirty = true;
         std::cout << "Contacts sorted by phone number.\n";
     }
 
     void sortByCompany() {
-        std::sort(contacts.begin(), contacts.end(), 
-            [](const Contact& a, const Contact& b) {
-                return a.getCompany() < b.getCompany();
-            });
-        buildIndex();
+        contacts.sort([](const Contact& a, const Contact& b) {
+            return a.getCompany() < b.getCompany();
+        });
+        columnsStale = true;
+        snapshotDirty = true;
         std::cout << "Contacts sorted by company.\n";
     }
 
     void sortByRecent() {
-        std::sort(contacts.begin(), contacts.end(), 
-            [](const Contact& a, const Contact& b) {
-                return a.getModifiedDate() > b.getModifiedDate();
-            });
-        buildIndex();
+        contacts.sort([](const Contact& a, const Contact& b) {
+            return a.getModifiedDate() > b.getModifiedDate();
+        });
+        columnsStale = true;
+        snapshotDirty = true;
         std::cout << "Contacts sorted by recent modification.\n";
     }
 
     // Tag management
     void addTagToContact(const std::string& phone, const std::string& tag) {
-        auto it = phoneIndex.find(phone);
-        if (it == phoneIndex.end()) {
+        ContactHandle handle = phoneHandle(phone);
+        Contact* contact = contacts.get(handle);
+        if (!contact) {
             std::cout << "Contact not found!\n";
             return;
         }
-        it->second->addTag(tag);
-        tagIndex[tag].push_back(it->second);
+        stats.remove(*contact);
+        contact->addTag(tag);
+        stats.add(*contact);
+        fullText.add(*contact);
+        columnsStale = true;
+        journal.appendTag(MutationJournal::AddTag, *contact, tag);
+        maybeCompact();
+        tagIndex.addTag(handle.index, tag);
         std::cout << "Tag '" << tag << "' added to contact.\n";
         checkAutoBackup();
     }
 
     void removeTagFromContact(const std::string& phone, const std::string& tag) {
-        auto it = phoneIndex.find(phone);
-        if (it == phoneIndex.end()) {
+        ContactHandle handle = phoneHandle(phone);
+        Contact* contact = contacts.get(handle);
+        if (!contact) {
             std::cout << "Contact not found!\n";
             return;
         }
-        it->second->removeTag(tag);
-        
-        // Update tag index
-        auto& tagContacts = tagIndex[tag];
-        tagContacts.erase(std::remove(tagContacts.begin(), tagContacts.end(), it->second), tagContacts.end());
-        if (tagContacts.empty()) {
-            tagIndex.erase(tag);
-        }
-        
+        stats.remove(*contact);
+        contact->removeTag(tag);
+        stats.add(*contact);
+        fullText.add(*contact);
+        columnsStale = true;
+        journal.appendTag(MutationJournal::RemoveTag, *contact, tag);
+        maybeCompact();
+        tagIndex.removeTag(handle.index, tag);
         std::cout << "Tag '" << tag << "' removed from contact.\n";
         checkAutoBackup();
     }
@@ -967,9 +6745,9 @@ public:
             std::cout << "No tags found.\n";
             return;
         }
-        for (const auto& entry : tagIndex) {
-            std::cout << entry.first << " (" << entry.second.size() << " contacts)\n";
-        }
+        tagIndex.forEachTag([](const std::string& tag, size_t count) {
+            std::cout << tag << " (" << count << " contacts)\n";
+        });
     }
 
     // Import/Export
@@ -1058,40 +6836,41 @@ public:
         }
     }
 
+    // Birthdays from today through the next `days` days, soonest first,
+    // from the birthday index. The result is cached as the day's digest:
+    // asking again the same day for the same window costs nothing until
+    // a contact or birthday changes.
+    const std::vector<BirthdayIndex::Upcoming>& birthdayDigest(int days = kBirthdayDigestDays) const {
+        auto now = std::time(nullptr);
+        std::tm today = *std::localtime(&now);
+        int day = BirthDate::dayNumber(today.tm_year + 1900, today.tm_mon + 1, today.tm_mday);
+        if (digest.day != day || digest.days != days || digest.version != birthdays.getVersion()) {
+            birthdays.upcoming(today.tm_year + 1900, today.tm_mon + 1, today.tm_mday, days, digest.entries);
+            digest.day = day;
+            digest.days = days;
+            digest.version = birthdays.getVersion();
+        }
+        return digest.entries;
+    }
+
     // Birthday reminders
-    void upcomingBirthdays(int days = 30) const {
+    void upcomingBirthdays(int days = kBirthdayDigestDays) const {
         std::cout << "\n=== UPCOMING BIRTHDAYS (next " << days << " days) ===\n";
-        auto now = std::time(nullptr);
-        std::tm* currentTm = std::localtime(&now);
-        int currentYear = currentTm->tm_year + 1900;
-        
         bool found = false;
         
-        for (const auto& contact : contacts) {
-            if (contact.getBirthday().empty()) continue;
-            
-            std::tm birthTm = {};
-            std::istringstream ss(contact.getBirthday());
-            ss >> std::get_time(&birthTm, "%Y-%m-%d");
-            if (ss.fail()) continue;
-            
-            // Set to current year
-            birthTm.tm_year = currentYear - 1900;
-            auto nextBirthday = std::mktime(&birthTm);
-            
-            double diff = std::difftime(nextBirthday, now) / (60 * 60 * 24);
-            if (diff >= 0 && diff <= days) {
-                std::cout << contact.getName() << " - " << contact.getBirthday();
-                if (diff == 0) {
-                    std::cout << " (Today!)";
-                } else if (diff == 1) {
-                    std::cout << " (Tomorrow!)";
-                } else {
-                    std::cout << " (in " << static_cast<int>(diff) << " days)";
-                }
-                std::cout << " - Age: " << contact.getAge() + 1 << std::endl;
-                found = true;
+        for (const auto& upcoming : birthdayDigest(days)) {
+            const Contact* contact = findById(upcoming.contactId);
+            if (!contact) continue;
+            std::cout << contact->getName() << " - " << contact->getBirthday();
+            if (upcoming.daysUntil == 0) {
+                std::cout << " (Today!)";
+            } else if (upcoming.daysUntil == 1) {
+                std::cout << " (Tomorrow!)";
+            } else {
+                std::cout << " (in " << upcoming.daysUntil << " days)";
             }
+            std::cout << " - Age: " << upcoming.year - contact->getBirthDate().year << std::endl;
+            found = true;
         }
         
         if (!found) {
@@ -1099,14 +6878,47 @@ public:
         }
     }
 
+    // One-line summary of the day's digest for the welcome screen
+    void showBirthdayDigest() const {
+        std::vector<std::string> today;
+        size_t later = 0;
+        for (const auto& upcoming : birthdayDigest()) {
+            const Contact* contact = findById(upcoming.contactId);
+            if (!contact) continue;
+            if (upcoming.daysUntil == 0) {
+                today.push_back(contact->getName());
+            } else {
+                ++later;
+            }
+        }
+        if (today.empty() && later == 0) return;
+        if (!today.empty()) {
+            std::cout << "Birthdays today: ";
+            for (size_t i = 0; i < today.size() && i < 5; ++i) std::cout << (i ? ", " : "") << today[i];
+            if (today.size() > 5) std::cout << " and " << today.size() - 5 << " more";
+            std::cout << (later ? ". " : ".\n");
+        }
+        if (later) {
+            std::cout << later << " upcoming birthday(s) in the next " << kBirthdayDigestDays
+                      << " days, see Advanced Features.\n";
+        }
+    }
+
     // Bulk operations
     void bulkAddTags(const std::vector<std::string>& phones, const std::string& tag) {
         int successCount = 0;
         for (const auto& phone : phones) {
-            auto it = phoneIndex.find(phone);
-            if (it != phoneIndex.end()) {
-                it->second->addTag(tag);
-                tagIndex[tag].push_back(it->second);
+            ContactHandle handle = phoneHandle(phone);
+            Contact* contact = contacts.get(handle);
+            if (contact) {
+                stats.remove(*contact);
+                contact->addTag(tag);
+                stats.add(*contact);
+                fullText.add(*contact);
+                columnsStale = true;
+                journal.appendTag(MutationJournal::AddTag, *contact, tag);
+                maybeCompact();
+                tagIndex.addTag(handle.index, tag);
                 successCount++;
             }
         }
@@ -1143,8 +6955,11 @@ public:
 
     // Backup management
     void createBackup() {
-        if (backupManager.createBackup(filename)) {
-            std::cout << "Backup created successfully!\n";
+        uint64_t ticket = requestBackup(true);
+        if (ticket != 0 && backupWorker.wait(ticket)) {
+            BackupStatus status = backupWorker.getStatus();
+            std::cout << "Backup created successfully! (" << status.lastNewBytes << " of "
+                      << status.lastTotalBytes << " bytes new)\n";
             logger.log("Manual backup created", "INFO");
         } else {
             std::cout << "Backup creation failed!\n";
@@ -1153,10 +6968,14 @@ public:
 
     // Quick actions
     void toggleFavorite(const std::string& phone) {
-        auto it = phoneIndex.find(phone);
-        if (it != phoneIndex.end()) {
-            it->second->setIsFavorite(!it->second->getIsFavorite());
-            std::cout << "Contact " << (it->second->getIsFavorite() ? "added to" : "removed from") << " favorites.\n";
+        Contact* contact = findByPhone(phone);
+        if (contact) {
+            stats.remove(*contact);
+            contact->setIsFavorite(!contact->getIsFavorite());
+            stats.add(*contact);
+            journal.appendFavorite(*contact);
+            maybeCompact();
+            std::cout << "Contact " << (contact->getIsFavorite() ? "added to" : "removed from") << " favorites.\n";
             checkAutoBackup();
         } else {
             std::cout << "Contact not found!\n";
@@ -1168,29 +6987,86 @@ public:
         return contacts.size();
     }
 
+    // Like every phone lookup this compares digits only, so formatting
+    // does not make a number new
     bool phoneExists(const std::string& phone) const {
-        return phoneIndex.find(phone) != phoneIndex.end();
+        return findByPhone(phone) != nullptr;
     }
 
     void displayStats() const {
         stats.display();
     }
 
+    void displayStorageStatus() const {
+        std::cout << "\n=== STORAGE STATUS ===\n";
+        std::cout << "Journal records: " << journal.getRecordCount()
+                  << " (" << journal.getByteCount() << " bytes)\n";
+        std::cout << "Last startup replay: " << lastReplayMicros / 1000.0 << " ms\n";
+        std::ifstream snapshot(filename, std::ios::binary | std::ios::ate);
+        std::cout << "Snapshot: " << (snapshot ? static_cast<long long>(snapshot.tellg()) : 0) << " bytes"
+                  << (storageOptions.compressSnapshots ? ", compressed" : "") << std::endl;
+        std::cout << "Indexes at startup: " << (indexesFromSnapshot ? "loaded from snapshot" : "rebuilt")
+                  << " in " << indexMicros / 1000.0 << " ms\n";
+        std::cout << "Phone and ID lookup tables: "
+                  << (phoneIndex.getMemoryBytes() + idIndex.getMemoryBytes()) / 1024 << " KiB\n";
+        std::cout << "Distinct name words for fuzzy search: " << fuzzyNames.getWordCount() << std::endl;
+        std::cout << "Distinct name sounds: " << phoneticNames.getKeyCount() << std::endl;
+        std::cout << "Birthdays indexed: " << birthdays.size() << std::endl;
+        if (!shadowedPhones.empty()) {
+            std::cout << "Contacts sharing another's phone digits (reachable by ID only): "
+                      << shadowedPhones.size() << std::endl;
+        }
+        std::cout << "Tag bitmaps: " << tagIndex.getMemoryBytes() / 1024 << " KiB\n";
+        std::cout << "Compaction: " << (compactor.isRunning() ? "running" : "idle") << std::endl;
+        std::cout << "Compactions completed: " << compactor.getCompletedCount() << std::endl;
+        std::cout << "Last compaction duration: " << compactor.getLastDurationMicros() / 1000.0 << " ms";
+        if (!compactor.getLastSucceeded()) std::cout << " (failed)";
+        std::cout << std::endl;
+        if (compactor.getFailedCount() > 0) {
+            std::cout << "Compaction failures: " << compactor.getFailedCount();
+            if (compactor.getConsecutiveFailures() > 0) {
+                std::cout << " (" << compactor.getConsecutiveFailures() << " in a row";
+                int64_t retryMillis = compactor.getRetryDelayMillis();
+                if (retryMillis > 0) std::cout << ", next retry in " << (retryMillis + 999) / 1000 << " s";
+                std::cout << ")";
+            }
+            std::cout << std::endl;
+        }
+        if (!compactor.isRunning() && fileExists(segmentPath())) {
+            std::ifstream segment(segmentPath(), std::ios::binary | std::ios::ate);
+            std::cout << "Journal segment awaiting compaction: "
+                      << static_cast<uint64_t>(segment.tellg()) / 1024 << " KiB\n";
+        }
+        
+        BackupStatus backup = backupWorker.getStatus();
+        std::cout << "Backups completed: " << backup.completed;
+        if (backup.failed > 0) std::cout << " (" << backup.failed << " failed)";
+        std::cout << std::endl;
+        if (backup.completed > 0) {
+            char completedBuffer[80];
+            std::tm completedTm = Logger::localTime(backup.lastCompleted);
+            std::strftime(completedBuffer, sizeof(completedBuffer), "%Y-%m-%d %H:%M:%S", &completedTm);
+            std::cout << "Last backup: " << completedBuffer << ", " << backup.lastDurationMillis << " ms, "
+                      << backup.lastNewBytes << " of " << backup.lastTotalBytes << " bytes new\n";
+        }
+        std::cout << "Backup queue: " << backup.pending << " pending"
+                  << (backup.running ? ", one running" : "") << ", "
+                  << backup.coalesced << " merged, " << backup.rejected << " refused\n";
+    }
+
     // Get contact by ID for external use
     Contact* getContactById(int id) {
-        auto it = idIndex.find(id);
-        if (it != idIndex.end()) {
-            return it->second;
-        }
-        return nullptr;
+        return findById(id);
     }
 
     // Get all contacts (for external processing)
-    const std::vector<Contact>& getAllContacts() const {
+    const ContactSlotMap& getAllContacts() const {
         return contacts;
     }
 };
 
+const size_t ContactManager::kParallelMinRecords;
+
 // Enhanced UI functions
 void displayMainMenu() {
     std::cout << "\n=== ADVANCED CONTACT MANAGEMENT SYSTEM ===\n";
@@ -1218,8 +7094,9 @@ void displayAdvancedMenu(ContactManager& manager) {
     std::cout << "5. Display Favorites\n";
     std::cout << "6. Display Recent Contacts\n";
     std::cout << "7. Toggle Favorite\n";
-    std::cout << "8. Back to Main Menu\n";
-    std::cout << "Choose an option (1-8): ";
+    std::cout << "8. Storage Status\n";
+    std::cout << "9. Back to Main Menu\n";
+    std::cout << "Choose an option (1-9): ";
     std::cin >> choice;
     std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 
@@ -1245,7 +7122,8 @@ void displayAdvancedMenu(ContactManager& manager) {
             manager.toggleFavorite(phone);
             break;
         }
-        case 8: return;
+        case 8: manager.displayStorageStatus(); break;
+        case 9: return;
         default: std::cout << "Invalid choice!\n";
     }
 }
@@ -1261,10 +7139,23 @@ void displaySearchMenu(ContactManager& manager) {
     std::cout << "4. Search by Company\n";
     std::cout << "5. Search by Tag\n";
     std::cout << "6. Global Search\n";
-    std::cout << "Choose search type (1-6): ";
+    std::cout << "7. Fuzzy Name Search\n";
+    std::cout << "8. Sounds-like Name Search\n";
+    std::cout << "9. Combined Query\n";
+    std::cout << "Choose search type (1-9): ";
     std::cin >> choice;
     std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 
+    if (choice == 2) {
+        std::cout << "(use 555* to match the start of a number, *1234 the end)\n";
+    } else if (choice == 3) {
+        std::cout << "(use @acme.com for everyone at a domain and its subdomains)\n";
+    } else if (choice == 7) {
+        std::cout << "(finds names up to 2 typos away per word, closest first)\n";
+    } else if (choice == 9) {
+        std::cout << "(e.g. company:acme tag:vip -tag:churned favorite modified>=2025-01-01;\n"
+                  << " start with 'explain' to see the plan)\n";
+    }
     std::cout << "Enter search term: ";
     std::getline(std::cin, query);
 
@@ -1275,6 +7166,15 @@ void displaySearchMenu(ContactManager& manager) {
         case 4: manager.searchByCompany(query); break;
         case 5: manager.searchByTag(query); break;
         case 6: manager.globalSearch(query); break;
+        case 7: manager.searchByNameFuzzy(query); break;
+        case 8: manager.searchByNameSoundsLike(query); break;
+        case 9:
+            if (query.compare(0, 8, "explain ") == 0) {
+                manager.runQuery(query.substr(8), true);
+            } else {
+                manager.runQuery(query);
+            }
+            break;
         default: std::cout << "Invalid choice!\n";
     }
 }
@@ -1307,7 +7207,8 @@ void displayTagMenu(ContactManager& manager) {
     std::cout << "1. Add Tag to Contact\n";
     std::cout << "2. Remove Tag from Contact\n";
     std::cout << "3. List All Tags\n";
-    std::cout << "Choose option (1-3): ";
+    std::cout << "4. Query Tags (AND/OR/NOT)\n";
+    std::cout << "Choose option (1-4): ";
     std::cin >> choice;
     std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 
@@ -1329,6 +7230,11 @@ void displayTagMenu(ContactManager& manager) {
         case 3:
             manager.listAllTags();
             break;
+        case 4:
+            std::cout << "Enter tag query (e.g. vip AND emea AND NOT churned): ";
+            std::getline(std::cin, tag);
+            manager.searchByTags(tag);
+            break;
         default: std::cout << "Invalid choice!\n";
     }
 }
@@ -1397,12 +7303,338 @@ void addContactMenu(ContactManager& manager) {
     manager.addContact(newContact);
 }
 
-int main() {
-    ContactManager manager("contacts.dat", true, 3600); // Auto-backup every hour
+// Allocation counting for the parser benchmark. Replacing the global
+// operator new has a cost of its own, so it is only compiled in on request:
+//   g++ -DCMS_COUNT_ALLOCS ... && ./a.out --bench-parser 100000
+#ifdef CMS_COUNT_ALLOCS
+static std::atomic<size_t> allocationCount(0);
+
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+static size_t allocationsSoFar() { return allocationCount.load(); }
+#else
+static size_t allocationsSoFar() { return 0; }
+#endif
+
+// Compares the stream extractor with TextRecordParser on generated
+// records in the legacy text format
+void runParserBenchmark(int records) {
+    std::string text;
+    {
+        std::ostringstream out;
+        for (int i = 0; i < records; ++i) {
+            Contact contact("Contact Number " + std::to_string(i), std::to_string(5550000000LL + i),
+                            "contact" + std::to_string(i) + "@example.com", std::to_string(i) + " Main Street",
+                            "Company " + std::to_string(i % 100), "Engineer");
+            contact.setNotes(i % 3 == 0 ? "Met at the annual conference in the spring" : "");
+            for (int t = 0; t < i % 4; ++t) contact.addTag("tag" + std::to_string(t));
+            out << contact;
+        }
+        text = out.str();
+    }
+    
+    auto measure = [records](const char* label, const std::function<size_t()>& parse) {
+        size_t allocationsBefore = allocationsSoFar();
+        auto start = std::chrono::steady_clock::now();
+        size_t parsed = parse();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t allocations = allocationsSoFar() - allocationsBefore;
+        
+        std::cout << std::left << std::setw(18) << label << std::right
+                  << std::setw(10) << parsed << " records  "
+                  << std::setw(12) << std::fixed << std::setprecision(0) << parsed / seconds << " records/s";
+#ifdef CMS_COUNT_ALLOCS
+        std::cout << "  " << std::setprecision(2) << static_cast<double>(allocations) / records << " allocs/record";
+#else
+        (void)allocations;
+#endif
+        std::cout << "\n";
+    };
+    
+    measure("stream extractor", [&text]() {
+        std::vector<Contact> contacts;
+        std::istringstream in(text);
+        Contact contact;
+        while (in >> contact) {
+            contacts.push_back(contact);
+        }
+        return contacts.size();
+    });
+    measure("buffer parser", [&text, records]() {
+        std::vector<Contact> contacts;
+        contacts.reserve(records);
+        const char* p = text.data();
+        const char* end = p + text.size();
+        while (p < end) {
+            contacts.push_back(ContactCodec::makeEmpty(0));
+            if (!TextRecordParser::parse(p, end, contacts.back())) {
+                contacts.pop_back();
+                break;
+            }
+        }
+        return contacts.size();
+    });
+#ifndef CMS_COUNT_ALLOCS
+    std::cout << "(build with -DCMS_COUNT_ALLOCS to count allocations)\n";
+#endif
+}
+
+// Prints one contact straight from the snapshot through its id index,
+// without loading the rest of the file. Journaled changes made since the
+// snapshot are not shown.
+int showStoredContact(const std::string& filename, int contactId) {
+    MappedFile mapped;
+    SnapshotFile::Header header;
+    if (!mapped.open(filename) || !SnapshotFile::readHeader(mapped.begin(), mapped.size(), header)) {
+        std::cout << "Error: " << filename << " is not a readable contact snapshot.\n";
+        return 1;
+    }
+    SimpleEncryption encryptor;
+    Contact contact;
+    if (!SnapshotFile::readContactById(mapped.begin(), mapped.size(), header, encryptor, contactId, contact)) {
+        std::cout << "Contact with ID " << contactId << " not found in " << filename << ".\n";
+        return 1;
+    }
+    contact.display();
+    return 0;
+}
+
+// Compares a global-search scan that folds every field per query, as
+// searches did before folded copies were kept, with one over the folded
+// copies
+void runSearchBenchmark(int records) {
+    std::vector<Contact> contacts;
+    contacts.reserve(records);
+    for (int i = 0; i < records; ++i) {
+        contacts.emplace_back("Contact Number " + std::to_string(i), std::to_string(5550000000LL + i),
+                              "Contact" + std::to_string(i) + "@Example.com", std::to_string(i) + " Main Street",
+                              "Company " + std::to_string(i % 100), "Engineer");
+        contacts.back().setNotes(i % 3 == 0 ? "Met at the Annual Conference in the spring" : "");
+        contacts.back().addTag("Tag" + std::to_string(i % 7));
+    }
+    const char* queries[] = {"annual", "company 42", "@example", "main street", "nomatch"};
+    const int kQueries = 5;
+    
+    auto measure = [records, kQueries](const char* label, const std::function<size_t(const std::string&)>& search,
+                                       const char* const* queryList) {
+        size_t allocationsBefore = allocationsSoFar();
+        auto start = std::chrono::steady_clock::now();
+        size_t matches = 0;
+        for (int q = 0; q < kQueries; ++q) matches += search(queryList[q]);
+        double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        size_t allocations = allocationsSoFar() - allocationsBefore;
+        
+        std::cout << std::left << std::setw(18) << label << std::right
+                  << std::setw(10) << matches << " matches  "
+                  << std::setw(10) << std::fixed << std::setprecision(2) << millis / kQueries << " ms/query";
+#ifdef CMS_COUNT_ALLOCS
+        std::cout << "  " << std::setprecision(2) << static_cast<double>(allocations) / kQueries / records
+                  << " allocs/row";
+#else
+        (void)allocations;
+        (void)records;
+#endif
+        std::cout << "\n";
+    };
+    
+    measure("fold per query", [&contacts](const std::string& query) {
+        std::string searchQuery = query;
+        std::transform(searchQuery.begin(), searchQuery.end(), searchQuery.begin(), ::tolower);
+        size_t matches = 0;
+        for (const auto& contact : contacts) {
+            auto checkField = [&](std::string field) {
+                std::transform(field.begin(), field.end(), field.begin(), ::tolower);
+                return field.find(searchQuery) != std::string::npos;
+            };
+            std::vector<std::string> tags = contact.getTags();
+            if (checkField(contact.getName()) || checkField(contact.getPhone()) || checkField(contact.getEmail()) ||
+                checkField(contact.getAddress()) || checkField(contact.getCompany()) ||
+                checkField(contact.getJobTitle()) || checkField(contact.getNotes()) ||
+                checkField(contact.getWebsite()) || checkField(contact.getSocialMedia()) ||
+                std::any_of(tags.begin(), tags.end(), checkField)) {
+                ++matches;
+            }
+        }
+        return matches;
+    }, queries);
+    measure("folded copies", [&contacts](const std::string& query) {
+        std::string foldedQuery = Contact::foldCase(query);
+        size_t matches = 0;
+        for (const auto& contact : contacts) {
+            if (contact.matchesFolded(foldedQuery)) ++matches;
+        }
+        return matches;
+    }, queries);
+    
+    PackedColumn packed;
+    for (const auto& contact : contacts) {
+        contact.appendSearchText(packed.buffer());
+        packed.endRow();
+    }
+    std::vector<size_t> rows;
+    measure("packed scan", [&packed, &rows](const std::string& query) {
+        packed.findRows(Contact::foldCase(query), rows);
+        return rows.size();
+    }, queries);
+    
+    // Raw kernel throughput: a needle that never occurs, over the whole buffer
+    const std::string& bytes = packed.buffer();
+    const int kPasses = 20;
+    auto start = std::chrono::steady_clock::now();
+    size_t found = 0;
+    for (int pass = 0; pass < kPasses; ++pass) {
+        found += SubstringScanner::find(bytes.data(), bytes.size(), "zq") != std::string::npos;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << SubstringScanner::kernelName() << " kernel: " << std::setprecision(2)
+              << bytes.size() * static_cast<double>(kPasses) / seconds / 1e9 << " GB/s over "
+              << bytes.size() / 1024 << " KiB" << (found ? " (unexpected match)" : "") << "\n";
+#ifndef CMS_COUNT_ALLOCS
+    std::cout << "(build with -DCMS_COUNT_ALLOCS to count allocations)\n";
+#endif
+}
+
+// Times fuzzy name lookups through the BK-tree against computing the edit
+// distance to every contact's name, and sounds-like lookups through the
+// phonetic index against coding every name per query. Surnames are built from syllables so
+// that, as with real names, many contacts share each word.
+void runFuzzyBenchmark(int records) {
+    static const char* const firstNames[] = {
+        "James", "Mary", "John", "Patricia", "Robert", "Jennifer", "Michael", "Linda", "William", "Elizabeth",
+        "David", "Barbara", "Richard", "Susan", "Joseph", "Jessica", "Thomas", "Sarah", "Charles", "Karen",
+        "Daniel", "Nancy", "Matthew", "Lisa", "Anthony", "Betty", "Mark", "Margaret", "Steven", "Sandra",
+        "Paul", "Ashley", "Andrew", "Emily", "Joshua", "Donna", "Kevin", "Michelle", "Brian", "Carol"
+    };
+    static const char* const syllables[] = {
+        "an", "ber", "car", "del", "ein", "fos", "gar", "hol", "ith", "jen", "kin", "lor", "mar",
+        "nel", "ope", "par", "quin", "ros", "son", "tor", "ul", "ver", "wil", "xan", "yor", "zel"
+    };
+    const size_t kFirst = sizeof(firstNames) / sizeof(firstNames[0]);
+    const size_t kSyllables = sizeof(syllables) / sizeof(syllables[0]);
+    
+    FuzzyNameIndex index;
+    PhoneticIndex phonetic;
+    std::vector<std::vector<std::string>> nameWords(records);
+    std::vector<std::string> names(records);
+    for (int i = 0; i < records; ++i) {
+        uint64_t pick = static_cast<uint64_t>(i) * 0x9E3779B97F4A7C15ULL;
+        std::string name = std::string(firstNames[(pick >> 8) % kFirst]) + " ";
+        int parts = 2 + static_cast<int>((pick >> 20) % 2);
+        for (int part = 0; part < parts; ++part) {
+            name += syllables[(pick >> (28 + part * 8)) % kSyllables];
+        }
+        name = Contact::foldCase(name);
+        index.add(i, name);
+        phonetic.add(i, name);
+        FullTextIndex::tokenize(name, nameWords[i]);
+        names[i] = name;
+    }
+    std::cout << records << " names, " << index.getWordCount() << " distinct words\n";
+    
+    const char* queries[] = {"Micheal Carsonn", "Elizabth Delrso", "Jhon Gareth", "Wilvr", "Sarha Tormarr"};
+    const int kQueries = 5;
+    const int kMaxTypos = 2;
+    
+    auto start = std::chrono::steady_clock::now();
+    size_t matches = 0;
+    std::vector<FuzzyNameIndex::Match> found;
+    for (int q = 0; q < kQueries; ++q) {
+        index.search(queries[q], kMaxTypos, found);
+        matches += found.size();
+    }
+    double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::left << std::setw(18) << "bk-tree" << std::right << std::setw(10) << matches
+              << " matches  " << std::setw(10) << std::fixed << std::setprecision(2) << millis / kQueries
+              << " ms/query\n";
+    
+    start = std::chrono::steady_clock::now();
+    matches = 0;
+    std::vector<int> row;
+    for (int q = 0; q < kQueries; ++q) {
+        std::vector<std::string> words;
+        FullTextIndex::tokenize(queries[q], words);
+        for (const auto& name : nameWords) {
+            bool all = true;
+            for (const auto& word : words) {
+                int allowed = std::min(kMaxTypos, static_cast<int>(word.size() / 2));
+                all = std::any_of(name.begin(), name.end(), [&](const std::string& nameWord) {
+                    return FuzzyNameIndex::editDistance(word, nameWord, row) <= allowed;
+                });
+                if (!all) break;
+            }
+            if (all) ++matches;
+        }
+    }
+    millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::left << std::setw(18) << "every contact" << std::right << std::setw(10) << matches
+              << " matches  " << std::setw(10) << millis / kQueries << " ms/query\n";
+    
+    const char* soundsLike[] = {"Jon Karson", "Mikael Delros", "Cathy Smyth", "Wilfer", "Sara Tormar"};
+    start = std::chrono::steady_clock::now();
+    matches = 0;
+    std::vector<int> ids;
+    for (int q = 0; q < kQueries; ++q) {
+        phonetic.search(soundsLike[q], ids, [&names](int id) { return &names[id]; });
+        matches += ids.size();
+    }
+    millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::left << std::setw(18) << "phonetic index" << std::right << std::setw(10) << matches
+              << " matches  " << std::setw(10) << millis / kQueries << " ms/query\n";
+    
+    start = std::chrono::steady_clock::now();
+    matches = 0;
+    for (int q = 0; q < kQueries; ++q) {
+        std::vector<std::string> words;
+        FullTextIndex::tokenize(soundsLike[q], words);
+        for (const auto& name : nameWords) {
+            bool all = true;
+            for (const auto& word : words) {
+                std::string code = PhoneticIndex::metaphone(word);
+                all = std::any_of(name.begin(), name.end(), [&code](const std::string& nameWord) {
+                    return PhoneticIndex::metaphone(nameWord) == code;
+                });
+                if (!all) break;
+            }
+            if (all) ++matches;
+        }
+    }
+    millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::left << std::setw(18) << "coding every name" << std::right << std::setw(10) << matches
+              << " matches  " << std::setw(10) << millis / kQueries << " ms/query\n";
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && std::string(argv[1]) == "--bench-parser") {
+        runParserBenchmark(argc >= 3 ? std::max(1, std::atoi(argv[2])) : 100000);
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench-search") {
+        runSearchBenchmark(argc >= 3 ? std::max(1, std::atoi(argv[2])) : 100000);
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench-fuzzy") {
+        runFuzzyBenchmark(argc >= 3 ? std::max(1, std::atoi(argv[2])) : 1000000);
+        return 0;
+    }
+    if (argc >= 3 && std::string(argv[1]) == "--show-contact") {
+        return showStoredContact("contacts.dat", std::atoi(argv[2]));
+    }
+    
+    StorageOptions storage;
+    storage.compressSnapshots = argc >= 2 && std::string(argv[1]) == "--compress";
+    ContactManager manager("contacts.dat", true, 3600, storage); // Auto-backup every hour
     int choice;
 
     std::cout << "Welcome to Advanced Contact Management System!\n";
     std::cout << "Features: Auto-backup, Encryption, Tags, Statistics, and more!\n";
+    manager.showBirthdayDigest();
 
     while (true) {
         displayMainMenu();
@@ -1430,7 +7662,7 @@ int main() {
             }
             case 5: {
                 int deleteChoice;
-                std::cout << "Delete by: 1. Phone 2. ID: ";
+                std::cout << "Delete by: 1. Phone 2. ID 3. Several IDs: ";
                 std::cin >> deleteChoice;
                 std::cin.ignore();
                 if (deleteChoice == 1) {
@@ -1438,6 +7670,16 @@ int main() {
                     std::cout << "Enter phone number to delete: ";
                     std::getline(std::cin, phone);
                     manager.deleteContact(phone);
+                } else if (deleteChoice == 3) {
+                    std::string line;
+                    std::cout << "Enter contact IDs separated by spaces or commas: ";
+                    std::getline(std::cin, line);
+                    std::replace(line.begin(), line.end(), ',', ' ');
+                    std::istringstream idStream(line);
+                    std::vector<int> ids;
+                    int id;
+                    while (idStream >> id) ids.push_back(id);
+                    manager.deleteContacts(ids);
                 } else {
                     int id;
                     std::cout << "Enter contact ID to delete: ";